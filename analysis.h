@@ -1,52 +1,303 @@
 #pragma once
 
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+#include "value.h"
 #include "instructions.h"
 
-bool isTempRead(CompilationResult* r, TempId id, size_t start = 0) {
-    for (size_t i = start; i < r->instructions.size(); ++i) {
-        const auto& instr = r->instructions[i];
-        bool usedHere = std::visit(
-            Overloaded{
-                [&](LInstrLoadConst lc) {
-                    return false;
-                },
-                [&](LInstrLoadSlot lc) {
-                    return false;
-                },
-                [&](LInstrAdd a) {
-                    return a.left == id || a.right == id;
-                },
-                [&](LInstrFillEmpty a) {
-                    return a.left == id || a.right == id;
-                },
-                [&](LInstrJmp j) {
-                    return false;
-                },
-                [&](LInstrMove m) {
-                    return m.src == id;
-                },
-                [&](LInstrMovePhi m) {
-                    return std::find(m.sources.begin(),
-                                     m.sources.end(),
-                                     id) != m.sources.end();
-                },
-                [&](LInstrLabel l) {
-                    return false;
-                },
-                [&](LInstrTestTruthy t) {
-                    return t.reg == id;
-                },
-                [&](LInstrTestFalsey t) {
-                    return t.reg == id;
-                },
-                [&](LInstrTestNothing t) {
-                    return t.reg == id;
+// Calls f(TempId) for every temp read by 'instr'.
+template <typename F>
+void forEachSource(const LInstr& instr, F f) {
+    std::visit(
+        Overloaded{
+            [&](const LInstrLoadConst& lc) {
+            },
+            [&](const LInstrLoadSlot& lc) {
+            },
+            [&](const LInstrAdd& a) {
+                f(a.left);
+                f(a.right);
+            },
+            [&](const LInstrFillEmpty& a) {
+                f(a.left);
+                f(a.right);
+            },
+            [&](const LInstrJmp& j) {
+            },
+            [&](const LInstrMove& m) {
+                f(m.src);
+            },
+            [&](const LInstrMovePhi& m) {
+                for (auto src : m.sources) {
+                    f(src);
                 }
             },
-            instr);
-        if (usedHere) {
-            return true;
+            [&](const LInstrLabel& l) {
+            },
+            [&](const LInstrTestTruthy& t) {
+                f(t.reg);
+            },
+            [&](const LInstrTestFalsey& t) {
+                f(t.reg);
+            },
+            [&](const LInstrTestNothing& t) {
+                f(t.reg);
+            }
+        },
+        instr);
+}
+
+// Calls f(TempId&) for every temp 'instr' reads or writes, so they can be changed.
+template <typename F>
+void forEachTempRef(LInstr& instr, F f) {
+    std::visit(
+        Overloaded{
+            [&](LInstrLoadConst& lc) {
+                f(lc.dst);
+            },
+            [&](LInstrLoadSlot& lc) {
+                f(lc.dst);
+            },
+            [&](LInstrAdd& a) {
+                f(a.dst);
+                f(a.left);
+                f(a.right);
+            },
+            [&](LInstrFillEmpty& a) {
+                f(a.dst);
+                f(a.left);
+                f(a.right);
+            },
+            [&](LInstrJmp& j) {
+            },
+            [&](LInstrMove& m) {
+                f(m.dst);
+                f(m.src);
+            },
+            [&](LInstrMovePhi& m) {
+                f(m.dst);
+                for (auto& src : m.sources) {
+                    f(src);
+                }
+            },
+            [&](LInstrLabel& l) {
+            },
+            [&](LInstrTestTruthy& t) {
+                f(t.reg);
+            },
+            [&](LInstrTestFalsey& t) {
+                f(t.reg);
+            },
+            [&](LInstrTestNothing& t) {
+                f(t.reg);
+            }
+        },
+        instr);
+}
+
+// One more than the highest TempId in 'r', for sizing tables indexed by TempId.
+size_t numTemps(const CompilationResult& r) {
+    size_t n = r.tempId + 1;
+    for (const auto& instr : r.instructions) {
+        if (auto dest = getDest(instr)) {
+            n = std::max<size_t>(n, *dest + 1);
+        }
+        forEachSource(instr, [&](TempId id) {
+            n = std::max<size_t>(n, id + 1);
+        });
+    }
+    return n;
+}
+
+// Where each temp is read, computed in a single pass over the instructions. Since we
+// only ever jump forward, a temp is live after instruction i exactly when it's read
+// by some instruction after i, so this is all the liveness information we need.
+struct TempUses {
+    static constexpr size_t kNotRead = ~size_t(0);
+
+    TempUses(const CompilationResult* r) {
+        for (size_t i = 0; i < r->instructions.size(); ++i) {
+            forEachSource(r->instructions[i], [&](TempId id) {
+                if (id >= count.size()) {
+                    count.resize(id + 1, 0);
+                    lastRead.resize(id + 1, kNotRead);
+                }
+                ++count[id];
+                lastRead[id] = i;
+            });
         }
     }
-    return false;
+
+    // Whether 'id' is read by any instruction at index 'start' or later.
+    bool isReadFrom(TempId id, size_t start) const {
+        return id < lastRead.size() && lastRead[id] != kNotRead && lastRead[id] >= start;
+    }
+    size_t numReads(TempId id) const {
+        return id < count.size() ? count[id] : 0;
+    }
+
+    // Indexed by TempId.
+    std::vector<size_t> count;
+    std::vector<size_t> lastRead;
+};
+
+// What's known about the values a temp can hold. This is a lattice: the default is
+// a temp with no values at all, and accumulateOr() joins two.
+struct TempConstraints {
+    // One bit per tag the temp can have, (1 << tag), with the tags we don't know
+    // about sharing the top bit.
+    static constexpr uint8_t kOtherTags = 1 << 7;
+    static uint8_t tagBit(Tag t) {
+        return t < 7 ? uint8_t(1 << t) : kOtherTags;
+    }
+    // Payloads in this range are stored inline in a packed register.
+    static constexpr int64_t kMinInline = -(int64_t(1) << 55);
+    static constexpr int64_t kMaxInline = (int64_t(1) << 55) - 1;
+
+    uint8_t tags = 0;
+    // Range of the payload, taken as signed. Nothing is 0 and bools are 0 or 1.
+    int64_t minVal = std::numeric_limits<int64_t>::max();
+    int64_t maxVal = std::numeric_limits<int64_t>::min();
+    // Whether packed builds might box the value, because it's owned or doesn't fit.
+    // This is worked out the same way whether we're building packed or not, so the
+    // bytecode doesn't depend on it.
+    bool canBeBoxed = false;
+
+    static TempConstraints any() {
+        return TempConstraints{0xff, std::numeric_limits<int64_t>::min(),
+                               std::numeric_limits<int64_t>::max(), true};
+    }
+    static TempConstraints constant(const ValTagOwned& c) {
+        auto v = int64_t(c.val);
+        return TempConstraints{tagBit(c.tag), v, v,
+                               c.owned || v < kMinInline || v > kMaxInline};
+    }
+
+    bool canBeNothing() const {
+        return tags & tagBit(kTagNothing);
+    }
+    // Truthiness is whether the payload is 0.
+    bool isAlwaysTruthy() const {
+        return tags && (minVal > 0 || maxVal < 0);
+    }
+    bool isNeverTruthy() const {
+        return tags && minVal == 0 && maxVal == 0;
+    }
+
+    TempConstraints accumulateOr(TempConstraints t) const {
+        return TempConstraints{uint8_t(tags | t.tags), std::min(minVal, t.minVal),
+                               std::max(maxVal, t.maxVal), canBeBoxed || t.canBeBoxed};
+    }
+
+    std::string print() const {
+        if (!tags) {
+            return "no-value";
+        }
+        std::stringstream out;
+        out << (canBeNothing() ? "maybe-nothing" : "not-nothing") << " tags";
+        for (Tag t = 0; t < 7; ++t) {
+            if (tags & tagBit(t)) {
+                out << " " << int(t);
+            }
+        }
+        if (tags & kOtherTags) {
+            out << " other";
+        }
+        out << " range [" << minVal << ", " << maxVal << "]";
+        if (canBeBoxed) {
+            out << " maybe-boxed";
+        }
+        return out.str();
+    }
+};
+
+// Adding follows addValues: Nothing if either side is, otherwise an int. Sums are
+// never boxed, since packed registers wrap at 56 bits. Unpacked ones wrap at 64
+// bits instead, so a sum which might not fit in 56 could have any payload.
+TempConstraints addConstraints(const TempConstraints& l, const TempConstraints& r) {
+    TempConstraints res;
+    if (!l.tags || !r.tags) {
+        return res;
+    }
+    auto nothingBit = TempConstraints::tagBit(kTagNothing);
+    if (l.canBeNothing() || r.canBeNothing()) {
+        res = res.accumulateOr(TempConstraints::constant(makeNothing()));
+    }
+    if ((l.tags & ~nothingBit) && (r.tags & ~nothingBit)) {
+        TempConstraints sum{TempConstraints::tagBit(kTagInt)};
+        bool overflows = __builtin_add_overflow(l.minVal, r.minVal, &sum.minVal) ||
+            __builtin_add_overflow(l.maxVal, r.maxVal, &sum.maxVal) ||
+            sum.minVal < TempConstraints::kMinInline || sum.maxVal > TempConstraints::kMaxInline;
+        if (overflows) {
+            sum.minVal = std::numeric_limits<int64_t>::min();
+            sum.maxVal = std::numeric_limits<int64_t>::max();
+        }
+        res = res.accumulateOr(sum);
+    }
+    return res;
+}
+
+// Joins what 'instr' can assign into the constraints of its destination. Every jump
+// goes forward, so the assignments which can reach an instruction all come before
+// it: running this over the instructions in order, the constraints at each one
+// cover whatever its sources can hold there.
+void updateConstraints(const LInstr& instr, std::vector<TempConstraints>* constraints) {
+    auto dest = getDest(instr);
+    if (!dest) {
+        return;
+    }
+    const auto& cs = *constraints;
+    auto c = std::visit(
+        Overloaded{
+            [&](const LInstrLoadConst& lc) {
+                return TempConstraints::constant(lc.constVal);
+            },
+            [&](const LInstrLoadSlot&) {
+                return TempConstraints::any();
+            },
+            [&](const LInstrAdd& a) {
+                return addConstraints(cs[a.left], cs[a.right]);
+            },
+            [&](const LInstrFillEmpty& a) {
+                const auto& l = cs[a.left];
+                const auto& r = cs[a.right];
+                if (!l.canBeNothing()) {
+                    return l;
+                }
+                if (l.tags == TempConstraints::tagBit(kTagNothing)) {
+                    return r;
+                }
+                // Either the left without Nothing, or the right.
+                auto res = l.accumulateOr(r);
+                res.tags = (l.tags & ~TempConstraints::tagBit(kTagNothing)) | r.tags;
+                return res;
+            },
+            [&](const LInstrMove& m) {
+                return cs[m.src];
+            },
+            [&](const LInstrMovePhi& m) {
+                TempConstraints res;
+                for (auto src : m.sources) {
+                    res = res.accumulateOr(cs[src]);
+                }
+                return res;
+            },
+            [&](const auto&) {
+                return TempConstraints::any();
+            }
+        },
+        instr);
+    (*constraints)[*dest] = cs[*dest].accumulateOr(c);
+}
+
+// Constraints of every temp, indexed by TempId. A temp assigned in several places,
+// as happens after phi removal, gets the join of all of them.
+std::vector<TempConstraints> computeConstraints(const CompilationResult& r) {
+    std::vector<TempConstraints> constraints(numTemps(r));
+    for (const auto& instr : r.instructions) {
+        updateConstraints(instr, &constraints);
+    }
+    return constraints;
 }
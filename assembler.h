@@ -1,10 +1,15 @@
 #pragma once
 
+#include <functional>
+#include <limits>
+#include <optional>
+#include <span>
 #include <sstream>
 
 #include "value.h"
 #include "instructions.h"
 #include "analysis.h"
+#include "regalloc.h"
 
 enum InstrCode : char {
     kLoadConst,
@@ -17,94 +22,410 @@ enum InstrCode : char {
     kTestTruthy,
     kTestFalsey,
     kJmp,
+    kTestNothing,
+    // Superinstructions. The assembler emits these instead of the unfused pairs.
+    kJmpIfTruthy,
+    kJmpIfFalsey,
+    kJmpIfNothing,
+    kAddConst,
+    // Immediate operand forms, for constants small enough to not need the pool.
+    kLoadImmInt,
+    kLoadImmTag,
+    kAddImm,
+    // Specialized forms without the checks, see InstrAddInt.
+    kAddInt,
+    kJmpIfTrue,
+    kJmpIfFalse,
+    // Prefix for the wide encoding, see below.
+    kWide,
 };
 
+// Returns the constant as an immediate that fits in T, if it's an int in T's range.
+template <typename T>
+std::optional<T> asImmediateInt(ValTagOwned c) {
+    auto v = int64_t(c.val);
+    if (c.tag != kTagInt || c.owned ||
+        v < std::numeric_limits<T>::min() || v > std::numeric_limits<T>::max()) {
+        return {};
+    }
+    return T(v);
+}
+
+// Bools and Nothing can be loaded with only the tag and a one byte payload.
+bool fitsImmediateTag(ValTagOwned c) {
+    return (c.tag == kTagBool || c.tag == kTagNothing) && !c.owned && c.val <= 0xff;
+}
+
+// Wide instructions are used when an operand doesn't fit the compact encoding: a
+// register above 255, a constant id above the compact limit, or a jump further
+// than 64KB. They're always 12 bytes and laid out the same way:
+//
+//   [kWide] [op] [a: u16] [b: u16] [c: u16] [x: u32]
+//
+// where a, b and c are registers (or a tag) and x is a constant id, an immediate
+// or a jump offset. Jumps are relative to the end of the instruction, as usual.
+const size_t kWideInstructionSize = 12;
+
+bool fitsByte(uint32_t v) {
+    return v <= 0xff;
+}
+
+// An instruction with its operands pulled out, regardless of how it was encoded.
+// Used by everything that walks bytecode outside of the interpreter's hot loop.
+struct DecodedInstr {
+    InstrCode op;
+    bool wide = false;
+    // Encoded size in bytes.
+    size_t size = kInstructionSize;
+    // Register operands (or a tag, for kLoadImmTag) in encoding order.
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+    // Constant id or immediate value.
+    int64_t x = 0;
+    // For jumps, the bytecode offset jumped to.
+    size_t target = 0;
+};
+
+bool isJumpInstr(InstrCode op) {
+    return op == kJmp || op == kJmpIfTruthy || op == kJmpIfFalsey || op == kJmpIfNothing ||
+        op == kJmpIfTrue || op == kJmpIfFalse;
+}
+
+DecodedInstr decodeInstr(const char* code, size_t off) {
+    const char* eip = code + off;
+    DecodedInstr d{InstrCode(*eip)};
+    if (d.op == kWide) {
+        d.op = InstrCode(*(eip + 1));
+        d.wide = true;
+        d.size = kWideInstructionSize;
+        d.a = readFromMemory<uint16_t>(eip + 2);
+        d.b = readFromMemory<uint16_t>(eip + 4);
+        d.c = readFromMemory<uint16_t>(eip + 6);
+        auto x = readFromMemory<uint32_t>(eip + 8);
+        d.x = (d.op == kLoadImmInt || d.op == kAddImm) ? int64_t(int32_t(x)) : int64_t(x);
+        if (isJumpInstr(d.op)) {
+            d.target = off + d.size + x;
+        }
+        return d;
+    }
+
+    d.a = uint8_t(*(eip + 1));
+    switch (d.op) {
+    case kLoadConst:
+    case kLoadSlot:
+        d.x = readFromMemory<uint16_t>(eip + 2);
+        break;
+    case kLoadImmInt:
+        d.x = readFromMemory<int16_t>(eip + 2);
+        break;
+    case kLoadImmTag:
+        d.b = uint8_t(*(eip + 2));
+        d.x = uint8_t(*(eip + 3));
+        break;
+    case kAddConst:
+        d.b = uint8_t(*(eip + 2));
+        d.x = uint8_t(*(eip + 3));
+        break;
+    case kAddImm:
+        d.b = uint8_t(*(eip + 2));
+        d.x = int8_t(*(eip + 3));
+        break;
+    case kJmp:
+        d.a = 0;
+        d.target = off + d.size + readFromMemory<uint16_t>(eip + 2);
+        break;
+    case kJmpIfTruthy:
+    case kJmpIfFalsey:
+    case kJmpIfNothing:
+    case kJmpIfTrue:
+    case kJmpIfFalse:
+        d.target = off + d.size + readFromMemory<uint16_t>(eip + 2);
+        break;
+    default:
+        d.b = uint8_t(*(eip + 2));
+        d.c = uint8_t(*(eip + 3));
+        break;
+    }
+    return d;
+}
+
+// Listing of the bytecode, one instruction per line. 'annotate', if given, is
+// called with the offset of each instruction and its result is added to the line.
+std::string printInstructions(std::span<const char> instructions,
+                              std::span<const ValTagOwned> constants,
+                              const std::function<std::string(size_t)>& annotate = {}) {
+    std::stringstream out;
+
+    const char* code = instructions.data();
+    auto constStr = [&](int64_t constId) {
+        std::stringstream c;
+        c << "C(" << (int)constants[constId].tag << ", " << constants[constId].val << ")";
+        return c.str();
+    };
+
+    out << "\n";
+    for (size_t off = 0; off < instructions.size();) {
+        auto d = decodeInstr(code, off);
+        const char* eip = code + off;
+        auto lineStart = out.tellp();
+        out << (void*)eip << " ";
+
+        switch(d.op) {
+        case kLoadConst:
+            out << "loadc       " << regStr(d.a) << " " << constStr(d.x);
+            break;
+        case kLoadSlot:
+            out << "loadslot    " << regStr(d.a) << " " << "slot(" << d.x << ")";
+            break;
+        case kMove:
+            out << "mov         " << regStr(d.a) << " " << regStr(d.b);
+            break;
+        case kAdd:
+            out << "add         " << regStr(d.a) << " " << regStr(d.b) << " " <<
+                regStr(d.c);
+            break;
+        case kFillEmpty:
+            out << "fillempty   " << regStr(d.a) << " " << regStr(d.b) << " " <<
+                regStr(d.c);
+            break;
+        case kEq:
+            out << "eq          " << regStr(d.a) << " " << regStr(d.b) << " " <<
+                regStr(d.c);
+            break;
+        case kJmp:
+            out << "jmp         " << (void*)(code + d.target);
+            break;
+        case kTestEq:
+            out << "testeq      " << regStr(d.a) + " " << regStr(d.b);
+            break;
+        case kTestTruthy:
+            out << "testt       " << regStr(d.a);
+            break;
+        case kTestFalsey:
+            out << "testf       " << regStr(d.a);
+            break;
+        case kTestNothing:
+            out << "testn       " << regStr(d.a);
+            break;
+        case kJmpIfTruthy:
+        case kJmpIfFalsey:
+        case kJmpIfNothing:
+            out << (d.op == kJmpIfTruthy ? "jmpt        " :
+                    d.op == kJmpIfFalsey ? "jmpf        " : "jmpn        ") <<
+                regStr(d.a) << " " << (void*)(code + d.target);
+            break;
+        case kAddConst:
+            out << "addc        " << regStr(d.a) << " " << regStr(d.b) << " " <<
+                constStr(d.x);
+            break;
+        case kLoadImmInt:
+            out << "loadi       " << regStr(d.a) << " " << d.x;
+            break;
+        case kLoadImmTag:
+            out << "loadi       " << regStr(d.a) << " " << "C(" << d.b << ", " << d.x <<
+                ")";
+            break;
+        case kAddImm:
+            out << "addi        " << regStr(d.a) << " " << regStr(d.b) << " " << d.x;
+            break;
+        case kAddInt:
+            out << "addint      " << regStr(d.a) << " " << regStr(d.b) << " " <<
+                regStr(d.c);
+            break;
+        case kJmpIfTrue:
+        case kJmpIfFalse:
+            out << (d.op == kJmpIfTrue ? "jmptrue     " : "jmpfalse    ") <<
+                regStr(d.a) << " " << (void*)(code + d.target);
+            break;
+        case kWide:
+            assert(0);
+            break;
+        }
+        if (d.wide) {
+            out << " (wide)";
+        }
+        if (annotate) {
+            auto width = size_t(out.tellp() - lineStart);
+            out << std::string(width < 56 ? 56 - width : 1, ' ') << annotate(off);
+        }
+        out << "\n";
+        off += d.size;
+    }
+
+    out << (void*)(code + instructions.size()) << " <END>\n";
+    return out.str();
+}
+
 struct ExecInstructions {
     void append(InstrLoadConst instr) {
-        instructions.push_back(InstrCode::kLoadConst);
-        instructions.push_back(instr.dst);
+        if (auto imm = asImmediateInt<int16_t>(instr.constVal); imm && fitsByte(instr.dst)) {
+            appendCompact16(kLoadImmInt, instr.dst, uint16_t(*imm));
+            return;
+        }
+        if (fitsImmediateTag(instr.constVal)) {
+            if (fitsByte(instr.dst)) {
+                appendCompact(kLoadImmTag, instr.dst, instr.constVal.tag, instr.constVal.val);
+            } else {
+                appendWide(kLoadImmTag, instr.dst, instr.constVal.tag, 0, instr.constVal.val);
+            }
+            return;
+        }
+        if (auto imm = asImmediateInt<int32_t>(instr.constVal); imm && !fitsByte(instr.dst)) {
+            appendWide(kLoadImmInt, instr.dst, 0, 0, uint32_t(*imm));
+            return;
+        }
 
         // TODO: This should look up whether we already have the constant anywhere.
         constants.push_back(instr.constVal);
-        
-        auto* addr = allocateSpace(sizeof(uint16_t));
-        const uint16_t offset16 = uint16_t(constants.size() - 1);
-        writeToMemory<uint16_t>(addr, offset16);
-
-        assert(instructions.size() % 4 == 0);
+        appendConstRef(kLoadConst, instr.dst, constants.size() - 1);
     }
 
     void append(InstrLoadSlot instr) {
-        instructions.push_back(InstrCode::kLoadSlot);
-        instructions.push_back(instr.dst);
-
-        // TODO: This should look up whether we already have the constant anywhere.
-        constants.push_back(ValTagOwned{(uint64_t)instr.slot, kTagSlot, 0});
-        
-        auto* addr = allocateSpace(sizeof(uint16_t));
-        const uint16_t offset16 = uint16_t(constants.size() - 1);
-        writeToMemory<uint16_t>(addr, offset16);
-
-        assert(instructions.size() % 4 == 0);
+        numSlots = std::max(numSlots, size_t(instr.slot) + 1);
+        appendConstRef(kLoadSlot, instr.dst, instr.slot);
     }
-    
+
     void append(InstrMove instr) {
-        instructions.push_back(InstrCode::kMove);
-        instructions.push_back(instr.dst);
-        instructions.push_back(instr.src);
-        instructions.push_back(88);
+        if (fitsByte(instr.dst) && fitsByte(instr.src)) {
+            appendCompact(kMove, instr.dst, instr.src, 88);
+        } else {
+            appendWide(kMove, instr.dst, instr.src, 0, 0);
+        }
     }
-    
+
     void append(InstrAdd instr) {
-        instructions.push_back(InstrCode::kAdd);
-        instructions.push_back(instr.dst);
-        instructions.push_back(instr.left);
-        instructions.push_back(instr.right);
-        assert(instructions.size() % 4 == 0);
+        appendThreeRegs(kAdd, instr.dst, instr.left, instr.right);
+    }
+    void append(InstrAddInt instr) {
+        appendThreeRegs(kAddInt, instr.dst, instr.left, instr.right);
     }
     void append(InstrEq instr) {
-        instructions.push_back(InstrCode::kEq);
-        instructions.push_back(instr.dst);
-        instructions.push_back(instr.left);
-        instructions.push_back(instr.right);
+        appendThreeRegs(kEq, instr.dst, instr.left, instr.right);
     }
     void append(InstrFillEmpty instr) {
-        instructions.push_back(InstrCode::kFillEmpty);
-        instructions.push_back(instr.dst);
-        instructions.push_back(instr.left);
-        instructions.push_back(instr.right);
+        appendThreeRegs(kFillEmpty, instr.dst, instr.left, instr.right);
     }
+
+    // The unfused tests only have a compact form. The assembler uses the fused
+    // conditional jumps when it can't encode these.
     void append(InstrTestEq instr) {
-        instructions.push_back(InstrCode::kTestEq);
-        instructions.push_back(instr.left);
-        instructions.push_back(instr.right);
-        instructions.push_back(0); // padding
+        appendCompact(kTestEq, instr.left, instr.right, 0 /* padding */);
     }
     void append(InstrTestTruthy instr) {
-        instructions.push_back(InstrCode::kTestTruthy);
-        instructions.push_back(instr.reg);
-        instructions.push_back(99);
-        instructions.push_back(99);
+        appendCompact(kTestTruthy, instr.reg, 99, 99);
     }
     void append(InstrTestFalsey instr) {
-        instructions.push_back(InstrCode::kTestFalsey);
-        instructions.push_back(instr.reg);
-        instructions.push_back(99);
-        instructions.push_back(99);
+        appendCompact(kTestFalsey, instr.reg, 99, 99);
+    }
+    void append(InstrTestNothing instr) {
+        appendCompact(kTestNothing, instr.reg, 99, 99);
+    }
+    bool canEncodeUnfusedTests() const {
+        return !wideJumps && numRegisters <= 0x100;
+    }
+
+    // The jumps return their offset, for fixing up later with setJumpTarget().
+    size_t append(InstrJmpIfTruthy instr) {
+        return appendJmp(kJmpIfTruthy, instr.reg, instr.off);
+    }
+    size_t append(InstrJmpIfFalsey instr) {
+        return appendJmp(kJmpIfFalsey, instr.reg, instr.off);
+    }
+    size_t append(InstrJmpIfNothing instr) {
+        return appendJmp(kJmpIfNothing, instr.reg, instr.off);
+    }
+    size_t append(InstrJmpIfTrue instr) {
+        return appendJmp(kJmpIfTrue, instr.reg, instr.off);
+    }
+    size_t append(InstrJmpIfFalse instr) {
+        return appendJmp(kJmpIfFalse, instr.reg, instr.off);
     }
-    
     size_t append(InstrJmp instr) {
-        instructions.push_back(InstrCode::kJmp);
-        instructions.push_back(0); // padding
-        auto* addr = allocateSpace(sizeof(uint16_t));
-        writeToMemory<uint16_t>(addr, instr.off);
+        return appendJmp(kJmp, 0 /* padding */, instr.off);
+    }
+
+    void append(InstrAddConst instr) {
+        bool regsFit = fitsByte(instr.dst) && fitsByte(instr.left);
+        if (auto imm = asImmediateInt<int8_t>(instr.constVal); imm && regsFit) {
+            appendCompact(kAddImm, instr.dst, instr.left, uint8_t(*imm));
+            return;
+        }
+        if (auto imm = asImmediateInt<int32_t>(instr.constVal); imm && !regsFit) {
+            appendWide(kAddImm, instr.dst, instr.left, 0, uint32_t(*imm));
+            return;
+        }
+        constants.push_back(instr.constVal);
+        auto constId = constants.size() - 1;
+        if (regsFit && fitsByte(constId)) {
+            appendCompact(kAddConst, instr.dst, instr.left, constId);
+        } else {
+            appendWide(kAddConst, instr.dst, instr.left, 0, constId);
+        }
+    }
 
-        assert(instructions.size() % 4 == 0);
+    // Points the jump at 'jmpOffset' to the bytecode offset 'target'. Returns false,
+    // leaving the jump alone, if it's compact and 'target' is too far away for it.
+    bool setJumpTarget(size_t jmpOffset, size_t target) {
+        bool wide = instructions[jmpOffset] == kWide;
+        // We jump from the end of the jump instruction.
+        auto from = jmpOffset + (wide ? kWideInstructionSize : kInstructionSize);
+        assert(target >= from);
+        if (wide) {
+            assert(target - from <= std::numeric_limits<uint32_t>::max());
+            writeToMemory<uint32_t>(instructions.data() + jmpOffset + 8, target - from);
+        } else if (target - from <= 0xffff) {
+            writeToMemory<uint16_t>(instructions.data() + jmpOffset + 2, target - from);
+        } else {
+            return false;
+        }
+        return true;
+    }
 
-        return instructions.size() - sizeof(uint16_t);
+    void appendCompact(InstrCode code, uint8_t a, uint8_t b, uint8_t c) {
+        instructions.push_back(code);
+        instructions.push_back(a);
+        instructions.push_back(b);
+        instructions.push_back(c);
     }
-    
-    
+    void appendCompact16(InstrCode code, uint8_t a, uint16_t x) {
+        instructions.push_back(code);
+        instructions.push_back(a);
+        writeToMemory<uint16_t>(allocateSpace(sizeof(uint16_t)), x);
+    }
+    void appendWide(InstrCode code, uint16_t a, uint16_t b, uint16_t c, uint32_t x) {
+        instructions.push_back(kWide);
+        instructions.push_back(code);
+        writeToMemory<uint16_t>(allocateSpace(sizeof(uint16_t)), a);
+        writeToMemory<uint16_t>(allocateSpace(sizeof(uint16_t)), b);
+        writeToMemory<uint16_t>(allocateSpace(sizeof(uint16_t)), c);
+        writeToMemory<uint32_t>(allocateSpace(sizeof(uint32_t)), x);
+    }
+    void appendThreeRegs(InstrCode code, Register a, Register b, Register c) {
+        if (fitsByte(a) && fitsByte(b) && fitsByte(c)) {
+            appendCompact(code, a, b, c);
+        } else {
+            appendWide(code, a, b, c, 0);
+        }
+    }
+    void appendConstRef(InstrCode code, Register dst, size_t constId) {
+        assert(constId <= std::numeric_limits<uint32_t>::max());
+        if (fitsByte(dst) && constId <= 0xffff) {
+            appendCompact16(code, dst, constId);
+        } else {
+            appendWide(code, dst, 0, 0, constId);
+        }
+    }
+    size_t appendJmp(InstrCode code, Register reg, uint32_t off) {
+        auto at = instructions.size();
+        if (!wideJumps && fitsByte(reg) && off <= 0xffff) {
+            appendCompact16(code, reg, off);
+        } else {
+            appendWide(code, reg, 0, 0, off);
+        }
+        return at;
+    }
+
     char* allocateSpace(size_t size) {
         auto oldSize = instructions.size();
         instructions.resize(oldSize + size);
@@ -115,193 +436,117 @@ struct ExecInstructions {
         return instructions.size();
     }
 
-    std::string print() {
-        std::stringstream out;
-        
-        const char* eip = instructions.data() - kInstructionSize;
-        const char* end = instructions.data() + instructions.size();
-        while (true) {
-            out << "\n";
-            eip += kInstructionSize;
-            if (eip == end) {
-                break;
-            }
-            assert(uintptr_t(eip - instructions.data()) % 4 == 0);
-            assert(eip < end);
-            InstrCode instrCode = *(InstrCode*)eip;
-            out << (void*)eip << " ";
-
-            switch(instrCode) {
-            case kLoadConst: {
-                auto regId = *(eip + 1);
-                auto constId = readFromMemory<uint16_t>(eip + 2);
-                
-                out << "loadc       " << regStr(regId) << " " << "C(" <<
-                    (int)constants[constId].tag << ", " << constants[constId].val << ")";
-                continue;
-            }
-            case kLoadSlot: {
-                auto regId = *(eip + 1);
-                auto constId = readFromMemory<uint16_t>(eip + 2);
-                
-                out << "loadslot    " << regStr(regId) << " " << "slot(" <<
-                    (void*)constants[constId].val << ")";
-                continue;
-            }
-            case kMove: {
-                auto dstId = *(eip + 1);
-                auto srcId = *(eip + 2);
-
-                out << "mov         " << regStr(dstId) << " " << regStr(srcId);
-                continue;
-            }
-            case kAdd: {
-                auto dstReg = *(eip + 1);
-                auto leftReg = *(eip + 2);
-                auto rightReg = *(eip + 3);
-                out << "add         " << regStr(dstReg) << " " <<
-                    regStr(leftReg) << " " << regStr(rightReg);
-                continue;
-            }
-            case kFillEmpty: {
-                auto dstReg = *(eip + 1);
-                auto valReg = *(eip + 2);
-                auto rightReg = *(eip + 3);
-                out << "fillempty   " << regStr(dstReg) << " " <<
-                    regStr(valReg) << " " << regStr(rightReg);
-                continue;
-            }
-            case kEq: {
-                assert(0);
-                break;
-            }
-            case kJmp: {
-                auto off = readFromMemory<uint16_t>(eip + 2 /* skip padding */);
-                // Add kInstructionSize, since we jump from the end of the jmp instruction.
-                out << "jmp         " << (void*)(eip + off + kInstructionSize);
-                continue;
-            }
-            case kTestEq: {
-                auto l = *(eip + 1);
-                auto r = *(eip + 2);
-                out << "testeq      " << regStr(l) + " " << regStr(r);
-                continue;
-            }
-            case kTestTruthy: {
-                auto v = *(eip + 1);
-                out << "testt       " << regStr(v);
-                continue;
-            }
-            case kTestFalsey: {
-                auto v = *(eip + 1);
-                out << "testf       " << regStr(v);
-                continue;
-            }
-            }
-
-            // Should never get here, because of uses of continue in above loop.
-            assert(0);
-        }
-
-        out << (void*)end << " <END>\n";
-        return out.str();
+    std::string print() const {
+        return "registers " + std::to_string(numRegisters) + "\n" +
+            printInstructions(instructions, constants);
     }
-    
+
     std::vector<char> instructions;
     std::vector<ValTagOwned> constants;
 
-    Register numRegisters = 0;
+    size_t numRegisters = 0;
+    // Entries the slot table passed at runtime needs, one past the highest slot read.
+    size_t numSlots = 0;
+    // Emit every jump in the wide form. Set by the assembler when a compact jump
+    // couldn't reach its target.
+    bool wideJumps = false;
 };
 
 struct AssembleCtx {
-    CompilationResult* compilationResult = nullptr;
-    Register registerId = 1; // Doesn't handle overflow
-    std::map<TempId, Register> tempToRegister;
-
-    // Changes as we go through the instructions. Last element in the vector
-    // is the current mapping.
-    std::map<Register, std::vector<TempId>> registerToTemp;
-
-    std::map<size_t, std::string> jumpsToFixUp;
-    std::map<std::string, size_t> labelOffsets;
-
-    Register nextRegister() {
-        assert(registerId < 250);
-        return registerId++;
+    AssembleCtx(CompilationResult* r)
+        : compilationResult(r),
+          uses(r),
+          registers(allocateRegisters(*r)),
+          constraints(numTemps(*r)) {
     }
 
+    CompilationResult* compilationResult = nullptr;
+    TempUses uses;
+    RegisterAllocation registers;
+    // Indexed by TempId, for picking the specialized instructions. Only covers the
+    // instructions assembled so far, which is all that can reach the current one,
+    // so it's more precise than the constraints of the whole program.
+    std::vector<TempConstraints> constraints;
+
+    // (bytecode offset of the jump, label it goes to)
+    std::vector<std::pair<size_t, LabelId>> jumpsToFixUp;
+    // Bytecode offset of each label, indexed by LabelId.
+    std::vector<size_t> labelOffsets;
+
     Register regFor(TempId id) {
-        assert(tempToRegister.count(id));
-        return tempToRegister[id];
+        return registers.regFor(id);
+    }
+    bool canAddUnchecked(TempId id) const {
+        return !constraints[id].canBeNothing() && !constraints[id].canBeBoxed;
     }
 };
 
-bool isTempLive(AssembleCtx* ctx,
-                TempId id,
-                size_t instructionIdx) {
-    // Assuming we only jump forward (which we do) this is right
-    return isTempRead(ctx->compilationResult,
-                      id,
-                      instructionIdx);
-}
+struct AssembleOptions {
+    // Emit superinstructions (fused test + jmp, loadc + add) where possible.
+    bool fuseInstructions = true;
+};
 
-void chooseRegister(AssembleCtx* ctx,
-                    TempId id,
-                    size_t instructionIdx) {
-    if (ctx->tempToRegister.count(id)) {
-        return;
-    }
-    // (Not optimal)
-
-    // Go through currently allocated registers, and determine if any of the temporaries
-    // they represent are no longer alive.
-    for (auto& [reg, tempIds] : ctx->registerToTemp) {
-        // We check if the temp is live AFTER this instruction, because during this instruction
-        // the temp is still valid to use as a source. For example if I have
-        // loadc T0, 123
-        // add T1, T0, 234
-        // <T0 never used again>
-        // I can use the same register for T0 and T1.
-        if (!isTempLive(ctx, tempIds.back(), instructionIdx + 1)) {
-            std::cout << "reg " << regStr(reg) << " can be used for " <<
-                tmpStr(id) << std::endl;
-            ctx->tempToRegister[id] = reg;
-            // Note that this invalidates iterators
-            ctx->registerToTemp[reg].push_back(id);
-            return;
+// Tries to emit the instruction at 'idx' fused together with the one after it.
+// Returns whether it did, in which case both have been consumed.
+bool appendFused(AssembleCtx* ctx, ExecInstructions* ret, size_t idx) {
+    const auto& instrs = ctx->compilationResult->instructions;
+    if (idx + 1 >= instrs.size()) {
+        return false;
+    }
+    const auto& instr = instrs[idx];
+    const auto& next = instrs[idx + 1];
+
+    if (auto jmp = getAlternative<LInstrJmp>(next)) {
+        std::optional<size_t> off;
+        if (auto t = getAlternative<LInstrTestTruthy>(instr)) {
+            auto reg = ctx->regFor(t->reg);
+            off = ctx->constraints[t->reg].canBeBoxed ?
+                ret->append(InstrJmpIfTruthy{reg, 999}) : ret->append(InstrJmpIfTrue{reg, 999});
+        } else if (auto t = getAlternative<LInstrTestFalsey>(instr)) {
+            auto reg = ctx->regFor(t->reg);
+            off = ctx->constraints[t->reg].canBeBoxed ?
+                ret->append(InstrJmpIfFalsey{reg, 999}) : ret->append(InstrJmpIfFalse{reg, 999});
+        } else if (auto t = getAlternative<LInstrTestNothing>(instr)) {
+            off = ret->append(InstrJmpIfNothing{ctx->regFor(t->reg), 999});
         }
+        if (off) {
+            ctx->jumpsToFixUp.push_back({*off, jmp->label});
+            return true;
+        }
+        return false;
     }
 
-    // Need a new register.
-    auto reg = ctx->nextRegister();
-    ctx->tempToRegister[id] = reg;
-    ctx->registerToTemp[reg].push_back(id);
-    std::cout << "Created new register " << regStr(reg) << " for " <<
-        tmpStr(id) << std::endl;
+    // loadc T, c followed by add using T, where T isn't needed afterwards.
+    auto lc = getAlternative<LInstrLoadConst>(instr);
+    auto add = getAlternative<LInstrAdd>(next);
+    if (lc && add && (add->left == lc->dst) != (add->right == lc->dst) &&
+        lc->dst != ctx->compilationResult->tempId &&
+        !ctx->uses.isReadFrom(lc->dst, idx + 2)) {
+        auto other = add->left == lc->dst ? add->right : add->left;
+        ret->append(InstrAddConst{ctx->regFor(add->dst), ctx->regFor(other), lc->constVal});
+        return true;
+    }
+    return false;
 }
-                          
 
-ExecInstructions assemble(CompilationResult* r) {
+// Assembles 'r' with every jump in the form 'wideJumps' asks for, where it can be.
+// Returns nullopt if a compact jump can't reach its target.
+std::optional<ExecInstructions> assembleJumps(CompilationResult* r, AssembleOptions opts,
+                                              bool wideJumps) {
     AssembleCtx ctx{r};
-    // We always put the output in register 0.
-    ctx.tempToRegister[r->tempId] = Register(0);
-
-    // Generate mapping for registers.
-    size_t idx = 0;
-    for (const auto& instr : r->instructions) {
-        auto dest = getDest(instr);
-        if (dest) {
-            chooseRegister(&ctx,
-                           *dest,
-                           idx);
-        }
-        ++idx;
-    }
 
     ExecInstructions ret;
-    ret.numRegisters = ctx.registerId;
-    
-    for (auto& instr : r->instructions) {
+    ret.numRegisters = ctx.registers.numRegisters;
+    ret.wideJumps = wideJumps;
+
+    bool fuse = opts.fuseInstructions || !ret.canEncodeUnfusedTests();
+    for (size_t i = 0; i < r->instructions.size(); ++i) {
+        if (fuse && appendFused(&ctx, &ret, i)) {
+            updateConstraints(r->instructions[i], &ctx.constraints);
+            updateConstraints(r->instructions[++i], &ctx.constraints);
+            continue;
+        }
+
         std::visit(
             Overloaded{
                 [&](LInstrLoadConst lc) {
@@ -319,6 +564,13 @@ ExecInstructions assemble(CompilationResult* r) {
                         });
                 },
                 [&](LInstrAdd a) {
+                    if (ctx.canAddUnchecked(a.left) && ctx.canAddUnchecked(a.right)) {
+                        ret.append(InstrAddInt{
+                                ctx.regFor(a.dst),
+                                ctx.regFor(a.left),
+                                ctx.regFor(a.right)});
+                        return;
+                    }
                     ret.append(InstrAdd{
                             ctx.regFor(a.dst),
                             ctx.regFor(a.left),
@@ -334,9 +586,12 @@ ExecInstructions assemble(CompilationResult* r) {
                     auto off = ret.append(InstrJmp{
                             999
                         });
-                    ctx.jumpsToFixUp[off] = j.labelName;
+                    ctx.jumpsToFixUp.push_back({off, j.label});
                 },
                 [&](LInstrMove m) {
+                    if (ctx.registers.isCoalesced(m)) {
+                        return;
+                    }
                     ret.append(InstrMove{
                             ctx.regFor(m.dst),
                             ctx.regFor(m.src)});
@@ -345,7 +600,10 @@ ExecInstructions assemble(CompilationResult* r) {
                     assert(0);
                 },
                 [&](LInstrLabel l) {
-                    ctx.labelOffsets[l.name] = ret.currentSize();
+                    if (l.label >= ctx.labelOffsets.size()) {
+                        ctx.labelOffsets.resize(l.label + 1);
+                    }
+                    ctx.labelOffsets[l.label] = ret.currentSize();
                 },
                 [&](LInstrTestTruthy t) {
                     ret.append(InstrTestTruthy{ctx.regFor(t.reg)});
@@ -354,21 +612,33 @@ ExecInstructions assemble(CompilationResult* r) {
                     ret.append(InstrTestFalsey{ctx.regFor(t.reg)});
                 },
                 [&](LInstrTestNothing t) {
-                    assert(0);
+                    ret.append(InstrTestNothing{ctx.regFor(t.reg)});
                 }
             },
-            instr);
+            r->instructions[i]);
+        updateConstraints(r->instructions[i], &ctx.constraints);
     }
 
 
     // Fix up the jumps.
-    for (auto& [byteCodeOffset, label] : ctx.jumpsToFixUp) {
-        // We add two to get the end of the jump instruction. That's where we jump from.
-        auto diff = ctx.labelOffsets[label] - (byteCodeOffset + 2);
-        writeToMemory<uint16_t>(ret.instructions.data() + byteCodeOffset,
-                                diff);
+    for (auto [byteCodeOffset, label] : ctx.jumpsToFixUp) {
+        assert(label < ctx.labelOffsets.size());
+        if (!ret.setJumpTarget(byteCodeOffset, ctx.labelOffsets[label])) {
+            return std::nullopt;
+        }
     }
     
     return ret;
     
 }
+
+ExecInstructions assemble(CompilationResult* r, AssembleOptions opts = {}) {
+    // Compact jumps reach 64KB ahead, which is enough for nearly every program, so
+    // only if one falls short is it all assembled again with wide jumps.
+    if (auto ret = assembleJumps(r, opts, false)) {
+        return std::move(*ret);
+    }
+    auto ret = assembleJumps(r, opts, true);
+    assert(ret);
+    return std::move(*ret);
+}
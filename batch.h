@@ -0,0 +1,393 @@
+#pragma once
+
+#include <algorithm>
+
+#include "value.h"
+#include "exec.h"
+
+// Number of rows evaluated together by BatchRuntime.
+const size_t kBatchSize = 1024;
+
+// The kernels below are element wise, so a destination register that is also an
+// operand can't stop them vectorizing. The compiler can't see that, and without
+// this it checks the registers for overlap at runtime and runs in place updates,
+// which are most of them, one row at a time.
+#if defined(__clang__)
+#define BATCH_VECTORIZE _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define BATCH_VECTORIZE _Pragma("GCC ivdep")
+#else
+#define BATCH_VECTORIZE
+#endif
+
+// Once no more than 1/kSparseFraction of the rows are active, instructions visit the
+// active rows from a list rather than going over the whole batch.
+const size_t kSparseFraction = 16;
+
+// Mask of the rows in a batch, one byte per row (0 or 1) so the kernels below can
+// use it directly as a select condition.
+using RowMask = std::vector<uint8_t>;
+
+// Runs a CompiledProgram over up to kBatchSize rows at once. Each register is a
+// column with the values and tags stored separately, and every instruction is
+// dispatched once per batch instead of once per row.
+//
+// Rows can take different paths through the program. Since we only ever jump
+// forward, we walk the bytecode once, keeping a mask of the rows that are "at" the
+// current instruction. Rows that take a jump are parked on the jump target and
+// merged back in when we get there. Only the rows being run are visited, and once
+// the rows have spread out over the branches, only the active ones.
+struct BatchRuntime {
+    BatchRuntime(const CompiledProgram* p)
+        : program(p),
+          vals(p->numRegisters * kBatchSize),
+          tags(p->numRegisters * kBatchSize),
+          active(kBatchSize),
+          slotColumns(p->numSlots, nullptr) {
+        activeRows.reserve(kBatchSize);
+        const char* code = program->instructions.data();
+        const size_t size = program->instructions.size();
+        assert(size % kInstructionSize == 0);
+
+        // Find all of the jump targets up front, so run() doesn't have to allocate.
+        // They're numbered in the order they appear in the code.
+        for (size_t off = 0; off < size;) {
+            auto d = decodeInstr(code, off);
+            if (isJumpInstr(d.op)) {
+                targetOffsets.push_back(d.target);
+            }
+            off += d.size;
+        }
+        std::sort(targetOffsets.begin(), targetOffsets.end());
+        targetOffsets.erase(std::unique(targetOffsets.begin(), targetOffsets.end()),
+                            targetOffsets.end());
+        targetAt.assign(size + 1, -1);
+        for (size_t idx = 0; idx < targetOffsets.size(); ++idx) {
+            targetAt[targetOffsets[idx]] = int(idx);
+        }
+        pending.assign(targetOffsets.size(), RowMask(kBatchSize, 0));
+        pendingRows.assign(targetOffsets.size(), 0);
+    }
+
+    // Makes the program read row i of 'slot' from column[i]. Binding a slot the
+    // program never reads is allowed, and does nothing.
+    void bindSlot(SlotId slot, const RegisterValue* column) {
+        if (slot < slotColumns.size()) {
+            slotColumns[slot] = column;
+        }
+    }
+
+    void run(size_t n) {
+        assert(n <= kBatchSize);
+        numRows = n;
+        std::fill(active.begin(), active.begin() + numRows, 1);
+        numActive = numRows;
+        updateActiveRows();
+
+        // Dispatch happens once per batch, so decoding cost doesn't matter much here.
+        const char* code = program->instructions.data();
+        const size_t size = program->instructions.size();
+        // The first jump target after 'off'.
+        size_t nextTarget = 0;
+        for (size_t off = 0; off <= size;) {
+            if (auto idx = targetAt[off]; idx >= 0) {
+                nextTarget = idx + 1;
+                if (pendingRows[idx] > 0) {
+                    numActive += pendingRows[idx];
+                    moveRows(active.data(), pending[idx].data());
+                    pendingRows[idx] = 0;
+                    updateActiveRows();
+                }
+            }
+            if (off == size) {
+                break;
+            }
+            if (numActive == 0) {
+                // Nothing can reach the code before the next jump target with rows
+                // waiting, so skip straight to it.
+                while (nextTarget < pendingRows.size() && pendingRows[nextTarget] == 0) {
+                    ++nextTarget;
+                }
+                off = nextTarget < targetOffsets.size() ? targetOffsets[nextTarget] : size;
+                continue;
+            }
+            auto d = decodeInstr(code, off);
+            off += d.size;
+
+            switch(d.op) {
+            case kLoadConst:
+                broadcast(d.a, program->constants[d.x]);
+                break;
+            case kLoadSlot:
+                assert(slotColumns[d.x]);
+                loadColumn(d.a, slotColumns[d.x]);
+                break;
+            case kMove:
+                move(d.a, d.b);
+                break;
+            case kAdd:
+                add(d.a, d.b, d.c);
+                break;
+            case kAddInt:
+                addInt(d.a, d.b, d.c);
+                break;
+            case kFillEmpty:
+                fillEmpty(d.a, d.b, d.c);
+                break;
+            case kEq:
+                assert(0);
+                break;
+            case kJmp:
+                branch(d.target, [](size_t) { return true; });
+                break;
+            case kTestEq: {
+                auto* lv = column(d.a);
+                auto* rv = column(d.b);
+                auto* lt = tagColumn(d.a);
+                auto* rt = tagColumn(d.b);
+                branch(consumeJmp(&off), [&](size_t i) {
+                    return lv[i] == rv[i] && lt[i] == rt[i];
+                });
+                break;
+            }
+            case kTestTruthy:
+            case kJmpIfTruthy:
+            case kJmpIfTrue: {
+                auto* v = column(d.a);
+                auto target = isJumpInstr(d.op) ? d.target : consumeJmp(&off);
+                branch(target, [&](size_t i) { return v[i] != 0; });
+                break;
+            }
+            case kTestFalsey:
+            case kJmpIfFalsey:
+            case kJmpIfFalse: {
+                auto* v = column(d.a);
+                auto target = isJumpInstr(d.op) ? d.target : consumeJmp(&off);
+                branch(target, [&](size_t i) { return v[i] == 0; });
+                break;
+            }
+            case kTestNothing:
+            case kJmpIfNothing: {
+                auto* t = tagColumn(d.a);
+                auto target = d.op == kJmpIfNothing ? d.target : consumeJmp(&off);
+                branch(target, [&](size_t i) { return t[i] == kTagNothing; });
+                break;
+            }
+            case kAddConst:
+                addConst(d.a, d.b, program->constants[d.x]);
+                break;
+            case kAddImm:
+                addConst(d.a, d.b, makeInt(int(d.x)));
+                break;
+            case kLoadImmInt:
+                broadcast(d.a, makeInt(int(d.x)));
+                break;
+            case kLoadImmTag:
+                broadcast(d.a, ValTagOwned{Value(d.x), Tag(d.b)});
+                break;
+            case kWide:
+                assert(0);
+                break;
+            }
+        }
+    }
+
+    ValTagOwned result(size_t row) const {
+        return ValTagOwned{vals[row], tags[row], false};
+    }
+
+    Value* column(Register r) {
+        return vals.data() + size_t(r) * kBatchSize;
+    }
+    Tag* tagColumn(Register r) {
+        return tags.data() + size_t(r) * kBatchSize;
+    }
+
+private:
+    // Moves past the jmp following an unfused test, returning its target. Rows that
+    // jumped straight to that jmp take it unconditionally.
+    size_t consumeJmp(size_t* off) {
+        auto d = decodeInstr(program->instructions.data(), *off);
+        assert(d.op == kJmp);
+        if (auto idx = targetAt[*off]; idx >= 0 && pendingRows[idx] > 0) {
+            auto targetIdx = targetAt[d.target];
+            moveRows(pending[targetIdx].data(), pending[idx].data());
+            pendingRows[targetIdx] += pendingRows[idx];
+            pendingRows[idx] = 0;
+        }
+        *off += d.size;
+        return d.target;
+    }
+
+    // dst |= src, then clears src. A row only ever waits in one place, so the masks
+    // never overlap and their counts just add up.
+    void moveRows(uint8_t* __restrict dst, uint8_t* __restrict src) {
+        const size_t n = numRows;
+        for (size_t i = 0; i < n; ++i) {
+            dst[i] |= src[i];
+            src[i] = 0;
+        }
+    }
+
+    // Decides between the mask and the list after numActive changes, building the
+    // list if needed. A branch on the list keeps it up to date itself.
+    void updateActiveRows() {
+        sparse = numActive * kSparseFraction <= numRows;
+        if (!sparse) {
+            return;
+        }
+        const size_t n = numRows;
+        activeRows.resize(n);
+        auto* rows = activeRows.data();
+        const auto* a = active.data();
+        size_t count = 0;
+        for (size_t i = 0; i < n; ++i) {
+            rows[count] = uint16_t(i);
+            count += a[i];
+        }
+        activeRows.resize(count);
+    }
+
+    // Conditional jump to 'targetOffset'. Active rows that pass the test move to the
+    // jump target.
+    template <typename Test>
+    void branch(size_t targetOffset, Test test) {
+        auto idx = targetAt[targetOffset];
+        auto* target = pending[idx].data();
+        auto* a = active.data();
+        size_t count = 0;
+        if (sparse) {
+            for (auto i : activeRows) {
+                uint8_t taken = test(i);
+                target[i] |= taken;
+                a[i] = !taken;
+                activeRows[count] = i;
+                count += !taken;
+            }
+            activeRows.resize(count);
+        } else {
+            // Written through uint8_t pointers, which could alias numRows as far as the
+            // compiler knows, so the bound has to be a local for this to vectorize.
+            const size_t n = numRows;
+            for (size_t i = 0; i < n; ++i) {
+                uint8_t taken = a[i] & uint8_t(test(i));
+                target[i] |= taken;
+                a[i] &= ~taken;
+                count += a[i];
+            }
+        }
+        pendingRows[idx] += numActive - count;
+        numActive = count;
+        if (!sparse) {
+            updateActiveRows();
+        }
+    }
+
+    // Sets 'dst' to compute(i) in each active row i. With most rows active, this
+    // computes every row and then selects on the active mask, which keeps it branch
+    // free so the compiler can vectorize it.
+    template <typename Compute>
+    void store(Register dst, Compute compute) {
+        auto* dv = column(dst);
+        auto* dt = tagColumn(dst);
+        if (sparse) {
+            for (auto i : activeRows) {
+                ValTagOwned v = compute(i);
+                dv[i] = v.val;
+                dt[i] = v.tag;
+            }
+            return;
+        }
+        const auto* __restrict a = active.data();
+        const size_t n = numRows;
+        BATCH_VECTORIZE
+        for (size_t i = 0; i < n; ++i) {
+            ValTagOwned v = compute(i);
+            dv[i] = a[i] ? v.val : dv[i];
+            dt[i] = a[i] ? v.tag : dt[i];
+        }
+    }
+
+    void broadcast(Register dst, ValTagOwned c) {
+        store(dst, [&](size_t) { return c; });
+    }
+
+    void loadColumn(Register dst, const RegisterValue* in) {
+        store(dst, [&](size_t i) { return fromRegister(in[i]); });
+    }
+
+    void move(Register dst, Register src) {
+        if (dst == src) {
+            return;
+        }
+        const auto* sv = column(src);
+        const auto* st = tagColumn(src);
+        store(dst, [&](size_t i) { return ValTagOwned{sv[i], st[i]}; });
+    }
+
+    void add(Register dst, Register left, Register right) {
+        const auto* lv = column(left);
+        const auto* lt = tagColumn(left);
+        const auto* rv = column(right);
+        const auto* rt = tagColumn(right);
+        store(dst, [&](size_t i) {
+            bool nothing = (lt[i] == kTagNothing) | (rt[i] == kTagNothing);
+            Value v = nothing ? 0 : wrapInt(lv[i] + rv[i]);
+            return ValTagOwned{v, nothing ? kTagNothing : kTagInt};
+        });
+    }
+
+    void addInt(Register dst, Register left, Register right) {
+        const auto* lv = column(left);
+        const auto* rv = column(right);
+        store(dst, [&](size_t i) { return ValTagOwned{wrapInt(lv[i] + rv[i]), kTagInt}; });
+    }
+
+    void addConst(Register dst, Register left, ValTagOwned c) {
+        const auto* lv = column(left);
+        const auto* lt = tagColumn(left);
+        store(dst, [&](size_t i) {
+            bool nothing = (lt[i] == kTagNothing) | (c.tag == kTagNothing);
+            Value v = nothing ? 0 : wrapInt(lv[i] + c.val);
+            return ValTagOwned{v, nothing ? kTagNothing : kTagInt};
+        });
+    }
+
+    void fillEmpty(Register dst, Register left, Register right) {
+        const auto* lv = column(left);
+        const auto* lt = tagColumn(left);
+        const auto* rv = column(right);
+        const auto* rt = tagColumn(right);
+        store(dst, [&](size_t i) {
+            bool nothing = lt[i] == kTagNothing;
+            return ValTagOwned{nothing ? rv[i] : lv[i], nothing ? rt[i] : lt[i]};
+        });
+    }
+
+    const CompiledProgram* program;
+
+    // Register columns, kBatchSize entries per register.
+    std::vector<Value> vals;
+    std::vector<Tag> tags;
+
+    // Rows being run, and how many of them are active.
+    size_t numRows = 0;
+    size_t numActive = 0;
+
+    RowMask active;
+    // When sparse, the active rows are also listed in activeRows, in order.
+    bool sparse = false;
+    std::vector<uint16_t> activeRows;
+    // Rows waiting at each jump target, and how many. Each mask is cleared as its
+    // rows are taken, so they're all clear again at the end of a run.
+    std::vector<RowMask> pending;
+    std::vector<size_t> pendingRows;
+    // Indexed by bytecode offset. The index into 'pending' if that offset is a jump
+    // target, otherwise -1.
+    std::vector<int> targetAt;
+    // The offset of each jump target, in order.
+    std::vector<size_t> targetOffsets;
+
+    // Indexed by slot id.
+    std::vector<const RegisterValue*> slotColumns;
+};
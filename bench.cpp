@@ -0,0 +1,507 @@
+// Interpreter microbenchmarks. Built separately from the demo in main.cpp:
+//
+//   g++ -std=c++20 -O3 -march=native -DNDEBUG bench.cpp -o bench && ./bench
+//
+// The batch kernels rely on auto-vectorization, so use -O3. Add -DEXEC_PACKED_VALUES=1
+// to measure the 8 byte value layout.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <vector>
+
+#include "value.h"
+#include "expression.h"
+#include "compile.h"
+#include "exec.h"
+#include "batch.h"
+#include "jit.h"
+#include "plancache.h"
+#include "serialize.h"
+
+// Every heap allocation in the process, so the compile benchmark can report how many
+// each compile does. The replacements are kept out of line: once inlined, gcc sees
+// the free() in delete paired with operator new and warns about every container.
+static size_t gAllocations = 0;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    ++gAllocations;
+    if (auto* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+// The nothrow forms, which std::stable_sort uses for its buffer, have to come from
+// here too. Otherwise their memory comes from the default new, and is freed below.
+__attribute__((noinline)) void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    ++gAllocations;
+    return malloc(size ? size : 1);
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+__attribute__((noinline)) void operator delete(void* p, const std::nothrow_t&) noexcept {
+    free(p);
+}
+
+struct BenchProgram {
+    std::string name;
+    ExecInstructions instructions = {};
+    // Number of instructions executed by one run, counting a test and the jmp it
+    // consumes as two.
+    size_t executedPerRun = 0;
+};
+
+// Blocks of loads, a data dependent branch and some arithmetic. The branch direction
+// is picked by a fixed seed so runs are comparable.
+BenchProgram makeMixedProgram(size_t numBlocks) {
+    BenchProgram p{"mixed-branches"};
+    auto& is = p.instructions;
+    uint32_t seed = 12345;
+
+    is.append(InstrLoadConst{Register(0), makeInt(0)});
+    is.append(InstrLoadConst{Register(3), makeNothing()});
+    p.executedPerRun = 2;
+    for (size_t i = 0; i < numBlocks; ++i) {
+        seed = seed * 1103515245 + 12345;
+        bool taken = (seed >> 16) & 1;
+
+        is.append(InstrLoadConst{Register(1), makeInt(int(i))});
+        is.append(InstrLoadConst{Register(2), makeBool(taken)});
+        is.append(InstrTestTruthy{Register(2)});
+        // Skips the add and the fillempty.
+        is.append(InstrJmp{2 * kInstructionSize});
+        is.append(InstrAdd{Register(0), Register(0), Register(1)});
+        is.append(InstrFillEmpty{Register(3), Register(3), Register(1)});
+        is.append(InstrMove{Register(4), Register(1)});
+        is.append(InstrAdd{Register(0), Register(0), Register(4)});
+        p.executedPerRun += taken ? 6 : 7;
+    }
+    is.numRegisters = 5;
+    return p;
+}
+
+BenchProgram makeStraightLineProgram(size_t numBlocks) {
+    BenchProgram p{"straight-line"};
+    auto& is = p.instructions;
+
+    is.append(InstrLoadConst{Register(0), makeInt(0)});
+    is.append(InstrLoadConst{Register(1), makeInt(1)});
+    p.executedPerRun = 2;
+    for (size_t i = 0; i < numBlocks; ++i) {
+        is.append(InstrAdd{Register(0), Register(0), Register(1)});
+        is.append(InstrMove{Register(2), Register(0)});
+        is.append(InstrFillEmpty{Register(1), Register(1), Register(2)});
+        p.executedPerRun += 3;
+    }
+    is.numRegisters = 3;
+    return p;
+}
+
+template <Dispatch dispatch>
+double nsPerInstruction(const BenchProgram& p, size_t iterations) {
+    CompiledProgram program(p.instructions);
+    ExecFrame rt(&program);
+    rt.run<dispatch>();
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        rt.run<dispatch>();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    // Keep the result alive so the runs can't be optimized out.
+    volatile Value sink = rt.result().val;
+    (void)sink;
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return ns / double(iterations * p.executedPerRun);
+}
+
+// fillEmpty(a + b, false), then a branch on the result, evaluated per row and per
+// batch.
+void benchRowsPerSecond() {
+    ExecInstructions is;
+    is.append(InstrLoadSlot{Register(1), 0});
+    is.append(InstrLoadSlot{Register(2), 1});
+    is.append(InstrAdd{Register(1), Register(1), Register(2)});
+    is.append(InstrLoadConst{Register(2), makeBool(false)});
+    is.append(InstrFillEmpty{Register(0), Register(1), Register(2)});
+    is.append(InstrTestTruthy{Register(0)});
+    is.append(InstrJmp{kInstructionSize});
+    is.append(InstrLoadConst{Register(0), makeInt(-1)});
+    is.numRegisters = 3;
+
+    std::vector<ValTagOwned> colA(kBatchSize);
+    std::vector<ValTagOwned> colB(kBatchSize);
+    for (size_t i = 0; i < kBatchSize; ++i) {
+        colA[i] = (i % 7 == 0) ? makeNothing() : makeInt(int(i % 5));
+        colB[i] = makeInt(int(i % 3) - 1);
+    }
+    std::vector<RegisterValue> inA, inB;
+    for (size_t i = 0; i < kBatchSize; ++i) {
+        inA.push_back(toRegister(colA[i]));
+        inB.push_back(toRegister(colB[i]));
+    }
+
+    const size_t kBatches = 2000;
+    CompiledProgram program(std::move(is));
+    ExecFrame rt(&program);
+    RegisterValue row[2];
+    rt.bindSlots(row);
+    Value sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t n = 0; n < kBatches; ++n) {
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            row[0] = inA[i];
+            row[1] = inB[i];
+            rt.run();
+            sum += rt.result().val;
+        }
+    }
+    auto mid = std::chrono::steady_clock::now();
+
+    BatchRuntime batch(&program);
+    batch.bindSlot(0, inA.data());
+    batch.bindSlot(1, inB.data());
+    for (size_t n = 0; n < kBatches; ++n) {
+        batch.run(kBatchSize);
+        sum += batch.result(n % kBatchSize).val;
+    }
+    auto end = std::chrono::steady_clock::now();
+    volatile Value sink = sum;
+    (void)sink;
+
+    auto rowsPerSec = [&](auto d) {
+        return double(kBatches * kBatchSize) / std::chrono::duration<double>(d).count();
+    };
+    std::cout << "rows/sec            row-at-a-time     batch of " << kBatchSize << "\n";
+    std::cout << "slot-add-branch     " << rowsPerSec(mid - start) << "       " <<
+        rowsPerSec(end - mid) << "\n";
+}
+
+// Input row for the and-chains below, which cycle through its slots.
+const std::vector<RegisterValue> kAndChainSlots{
+    makeRegister(1, kTagInt), makeRegister(2, kTagInt),
+    makeRegister(3, kTagInt), makeRegister(4, kTagInt)};
+
+// slot0 && slot1 && ... with 'depth' operands. Every operand needs both a nothing
+// and a falsey check, each of which is a test + jmp pair when not fused.
+OwnedExpression makeAndChain(size_t depth) {
+    OwnedExpression expr = makeSlot(0);
+    for (size_t i = 1; i < depth; ++i) {
+        expr = std::make_unique<ExpressionBinOp>(
+            BinOpType::kAnd, std::move(expr), makeSlot(i % kAndChainSlots.size()));
+    }
+    return expr;
+}
+
+void benchAndChains() {
+    const size_t kIterations = 200000;
+
+    std::cout << "and-chain depth     unfused ns/eval   fused ns/eval     " <<
+        "unfused/fused instrs\n";
+    for (size_t depth : {4, 16, 64}) {
+        double nsPerEval[2];
+        size_t numInstrs[2];
+        for (bool fuse : {false, true}) {
+            CompileOptions opts;
+            opts.assemble.fuseInstructions = fuse;
+            auto program = compile(makeAndChain(depth), opts);
+            ExecFrame frame(&program);
+            frame.bindSlots(kAndChainSlots.data());
+
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < kIterations; ++i) {
+                frame.run();
+            }
+            auto end = std::chrono::steady_clock::now();
+            volatile Value sink = frame.result().val;
+            (void)sink;
+
+            nsPerEval[fuse] = std::chrono::duration<double, std::nano>(end - start).count() /
+                double(kIterations);
+            numInstrs[fuse] = program.instructions.size() / kInstructionSize;
+        }
+        auto name = std::to_string(depth);
+        std::cout << name << std::string(20 - name.size(), ' ') << nsPerEval[0] <<
+            "           " << nsPerEval[1] << "           " << numInstrs[0] << "/" <<
+            numInstrs[1] << "\n";
+    }
+}
+
+// slot0 + slot1 + ... with 'size' operands.
+OwnedExpression makeAddChain(size_t size) {
+    OwnedExpression expr = makeSlot(0);
+    for (size_t i = 1; i < size; ++i) {
+        expr = std::make_unique<ExpressionBinOp>(
+            BinOpType::kAdd, std::move(expr), makeSlot(i % kAndChainSlots.size()));
+    }
+    return expr;
+}
+
+// if slot0 + 1 then (slot0 + 1) + slot1 else slot0, which repeats a subexpression
+// in the condition and a branch.
+OwnedExpression makeSharedIf() {
+    auto plusOne = [] {
+        return std::make_unique<ExpressionBinOp>(BinOpType::kAdd, makeSlot(0), makeConstInt(1));
+    };
+    return std::make_unique<ExpressionIf>(
+        plusOne(),
+        std::make_unique<ExpressionBinOp>(BinOpType::kAdd, plusOne(), makeSlot(1)),
+        makeSlot(0));
+}
+
+// How many instructions value numbering removes from each of the expressions used
+// above. Both chains cycle through four slots, but only the add chain's repeated
+// loads are merged. Each load in the and chain feeds the phi at its end, so they're
+// all kept.
+void benchValueNumbering() {
+    std::vector<std::pair<std::string, OwnedExpression>> exprs;
+    exprs.push_back({"and-chain-64", makeAndChain(64)});
+    exprs.push_back({"add-chain-64", makeAddChain(64)});
+    exprs.push_back({"shared-if", makeSharedIf()});
+
+    std::cout << "value numbering     instrs    removed\n";
+    for (auto& [name, expr] : exprs) {
+        CompileCtx ctx;
+        expr = expr->optimize(std::move(expr));
+        auto res = expr->compile(&ctx);
+        auto numInstrs = std::to_string(res.instructions.size());
+        OptimizationCtx optCtx;
+        optimizePreSSA(&optCtx, &res);
+        std::cout << name << std::string(20 - name.size(), ' ') << numInstrs <<
+            std::string(10 - numInstrs.size(), ' ') << optCtx.numRedundant << "\n";
+    }
+}
+
+// Time to run the whole compile pipeline, which should grow linearly with the size
+// of the expression.
+void benchCompileLatency() {
+    std::cout << "compile latency     size     us/compile      ns/node      allocs/node\n";
+    for (auto [name, make] : {std::pair{"and-chain", &makeAndChain},
+                              std::pair{"add-chain", &makeAddChain}}) {
+        for (size_t size : {64, 256, 1024, 4096}) {
+            // Enough repetitions to get a stable number for the small ones.
+            size_t reps = std::max<size_t>(1, 16384 / size);
+            std::vector<OwnedExpression> exprs;
+            for (size_t i = 0; i < reps; ++i) {
+                exprs.push_back(make(size));
+            }
+
+            auto allocationsBefore = gAllocations;
+            auto start = std::chrono::steady_clock::now();
+            for (auto& e : exprs) {
+                volatile size_t sink = compileInstructions(std::move(e)).instructions.size();
+                (void)sink;
+            }
+            auto end = std::chrono::steady_clock::now();
+            auto allocations = gAllocations - allocationsBefore;
+
+            double us = std::chrono::duration<double, std::micro>(end - start).count() /
+                double(reps);
+            auto label = std::string(name);
+            auto sizeStr = std::to_string(size);
+            std::cout << label << std::string(20 - label.size(), ' ') << sizeStr <<
+                std::string(9 - sizeStr.size(), ' ') << us << "         " <<
+                us * 1000 / double(size) << "      " <<
+                double(allocations) / double(reps * size) << "\n";
+        }
+    }
+}
+
+// Time spent optimizing, and what's left afterwards, for each budget of
+// iterations, followed by what each pass did with the largest one.
+void benchOptimizationBudget() {
+    std::cout << "optimization budget budget   us/optimize     instrs\n";
+    for (auto [name, make] : {std::pair{"and-chain-1024", &makeAndChain},
+                              std::pair{"add-chain-1024", &makeAddChain}}) {
+        OptimizationCtx lastCtx;
+        for (size_t budget : {1, 2, 4}) {
+            const size_t reps = 16;
+            std::vector<CompilationResult> results;
+            for (size_t i = 0; i < reps; ++i) {
+                CompileCtx ctx;
+                auto expr = make(1024);
+                expr = expr->optimize(std::move(expr));
+                results.push_back(expr->compile(&ctx));
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            for (auto& res : results) {
+                OptimizationCtx optCtx;
+                optCtx.maxIterations = budget;
+                optimizePreSSA(&optCtx, &res);
+                removePhi(&res);
+                optimizePostSSA(&optCtx, &res);
+                lastCtx = std::move(optCtx);
+            }
+            auto end = std::chrono::steady_clock::now();
+
+            double us = std::chrono::duration<double, std::micro>(end - start).count() /
+                double(reps);
+            auto label = std::string(name);
+            auto budgetStr = std::to_string(budget);
+            std::cout << label << std::string(20 - label.size(), ' ') << budgetStr <<
+                std::string(9 - budgetStr.size(), ' ') << us << "         " <<
+                results.back().instructions.size() << "\n";
+        }
+        for (const auto& stats : lastCtx.pipelineStats) {
+            std::cout << stats.print();
+        }
+    }
+}
+
+// (slot0 + c0) && (slot1 + c1) && ... with 'depth' operands, where the constants
+// come from 'seed'. Every seed gives the same shape.
+OwnedExpression makeConstAndChain(size_t depth, size_t seed) {
+    auto operand = [&](size_t i) {
+        return std::make_unique<ExpressionBinOp>(
+            BinOpType::kAdd, makeSlot(i % kAndChainSlots.size()),
+            makeConstInt(int((seed * 31 + i * 7) % 100) + 1));
+    };
+    OwnedExpression expr = operand(0);
+    for (size_t i = 1; i < depth; ++i) {
+        expr = std::make_unique<ExpressionBinOp>(BinOpType::kAnd, std::move(expr), operand(i));
+    }
+    return expr;
+}
+
+// Time to get a runnable program for expressions which only differ in their
+// constants, compiling every one versus looking them up in a PlanCache.
+void benchPlanCache() {
+    std::cout << "plan cache          size     compile us      lookup us\n";
+    for (size_t size : {16, 64, 256}) {
+        const size_t reps = 256;
+        std::vector<OwnedExpression> toCompile;
+        std::vector<OwnedExpression> toLookUp;
+        for (size_t i = 0; i < reps; ++i) {
+            toCompile.push_back(makeConstAndChain(size, i));
+            toLookUp.push_back(makeConstAndChain(size, i));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (auto& e : toCompile) {
+            volatile size_t sink = compileInstructions(std::move(e)).instructions.size();
+            (void)sink;
+        }
+        auto mid = std::chrono::steady_clock::now();
+        PlanCache cache(size_t(1) << 20);
+        for (auto& e : toLookUp) {
+            volatile size_t sink = cache.lookup(std::move(e)).params.size();
+            (void)sink;
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        auto usPerRep = [&](auto d) {
+            return std::chrono::duration<double, std::micro>(d).count() / double(reps);
+        };
+        auto sizeStr = std::to_string(size);
+        std::cout << "const-and-chain     " << sizeStr << std::string(9 - sizeStr.size(), ' ') <<
+            usPerRep(mid - start) << "         " << usPerRep(end - mid) << "\n";
+    }
+}
+
+// Time to get a runnable program by compiling it, versus loading it from the
+// serialized form, which includes verifying the bytecode.
+void benchProgramFile() {
+    std::cout << "program file        size     compile us      load us\n";
+    for (size_t size : {64, 256, 1024}) {
+        const size_t reps = 64;
+        auto program = compile(makeAndChain(size));
+        auto bytes = *serializeProgram(program);
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < reps; ++i) {
+            volatile size_t sink = compileInstructions(makeAndChain(size)).instructions.size();
+            (void)sink;
+        }
+        auto mid = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < reps; ++i) {
+            volatile size_t sink = loadProgram(bytes)->instructions.size();
+            (void)sink;
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        auto usPerRep = [&](auto d) {
+            return std::chrono::duration<double, std::micro>(d).count() / double(reps);
+        };
+        auto sizeStr = std::to_string(size);
+        std::cout << "and-chain           " << sizeStr << std::string(9 - sizeStr.size(), ' ') <<
+            usPerRep(mid - start) << "         " << usPerRep(end - mid) << "\n";
+    }
+}
+
+void benchNative() {
+    const size_t kIterations = 200000;
+
+    std::vector<BenchProgram> programs;
+    programs.push_back(makeMixedProgram(500));
+    programs.push_back(BenchProgram{
+            "and-chain-64",
+            compileInstructions(makeAndChain(64))});
+
+    std::cout << "program             interpreted ns/eval   native ns/eval\n";
+    for (auto& p : programs) {
+        CompiledProgram program(p.instructions);
+        // Threshold of 1 so the first run compiles.
+        TieredProgram native(&program, 1);
+        ExecFrame frame(&program);
+        frame.bindSlots(kAndChainSlots.data());
+        native.run(&frame);
+        if (!native.isNative()) {
+            std::cout << p.name << ": no native code generated\n";
+            continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < kIterations; ++i) {
+            frame.run();
+        }
+        auto mid = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < kIterations; ++i) {
+            native.run(&frame);
+        }
+        auto end = std::chrono::steady_clock::now();
+        volatile Value sink = frame.result().val;
+        (void)sink;
+
+        auto nsPerEval = [&](auto d) {
+            return std::chrono::duration<double, std::nano>(d).count() / double(kIterations);
+        };
+        std::cout << p.name << std::string(20 - p.name.size(), ' ') << nsPerEval(mid - start) <<
+            "               " << nsPerEval(end - mid) << "\n";
+    }
+}
+
+int main() {
+    const size_t kIterations = 20000;
+
+    std::vector<BenchProgram> programs;
+    programs.push_back(makeMixedProgram(500));
+    programs.push_back(makeStraightLineProgram(500));
+
+    std::cout << "threaded dispatch " <<
+        (EXEC_HAS_COMPUTED_GOTO ? "available" : "unavailable (using switch)") << "\n";
+    std::cout << "program             switch ns/instr   threaded ns/instr\n";
+    for (auto& p : programs) {
+        auto switchNs = nsPerInstruction<Dispatch::kSwitch>(p, kIterations);
+        auto threadedNs = nsPerInstruction<Dispatch::kThreaded>(p, kIterations);
+        std::cout << p.name << std::string(20 - p.name.size(), ' ') <<
+            switchNs << "          " << threadedNs << "\n";
+    }
+
+    benchRowsPerSecond();
+    benchAndChains();
+    benchNative();
+    benchValueNumbering();
+    benchCompileLatency();
+    benchOptimizationBudget();
+    benchPlanCache();
+    benchProgramFile();
+    return 0;
+}
@@ -0,0 +1,217 @@
+// Benchmark suite over generated expressions, for tracking regressions and seeing
+// which engine changes pay off. Built separately from bench.cpp, whose numbers are
+// for reading, while this prints one CSV line per case:
+//
+//   g++ -std=c++20 -O3 -march=native -DNDEBUG benchsuite.cpp -o benchsuite
+//   ./benchsuite [seed] > results.csv
+//
+// A case is an ExprGenerator shape and size. Compile times are per stage, each the
+// median over several compiles of the same expression. Rows/sec are the median of
+// several timed passes over the same kBatchSize rows, run one row at a time, as a
+// batch, and as native code (0 where there is no native tier). The checksum covers
+// every row's result, so it only changes when behaviour does, and the suite fails
+// if the ways of running a program disagree.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "value.h"
+#include "expression.h"
+#include "exprgen.h"
+#include "compile.h"
+#include "exec.h"
+#include "batch.h"
+#include "jit.h"
+
+using Clock = std::chrono::steady_clock;
+
+const SlotId kNumSlots = 8;
+const size_t kTrials = 5;
+// How long each timed pass over the rows should take, roughly.
+const auto kPassTime = std::chrono::milliseconds(5);
+
+double median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+double microseconds(Clock::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+struct CompileTimes {
+    double optimize = 0;
+    double compile = 0;
+    double passes = 0;
+    double assemble = 0;
+};
+
+// Compiles the case 'reps' times, timing the stages of compileInstructions()
+// separately, and returns the median times along with the program. Every stage
+// between compiling and assembling counts as an optimization pass.
+ExecInstructions compileCase(ExprShape shape, size_t size, uint64_t seed, size_t reps,
+                             CompileTimes* times) {
+    std::vector<double> optimizeUs, compileUs, passesUs, assembleUs;
+    ExecInstructions is;
+    for (size_t i = 0; i < reps; ++i) {
+        ExprGenerator gen(seed, kNumSlots);
+        auto expr = gen.generate(shape, size);
+
+        TimingTrace timing;
+        is = compileInstructions(std::move(expr), CompileOptions{}, timing);
+
+        CompileTimes t;
+        for (auto [stage, time] : timing.stages) {
+            auto us = microseconds(time);
+            if (stage == "simplified") {
+                t.optimize += us;
+            } else if (stage == "compiled") {
+                t.compile += us;
+            } else if (stage == "assembled") {
+                t.assemble += us;
+            } else {
+                t.passes += us;
+            }
+        }
+        optimizeUs.push_back(t.optimize);
+        compileUs.push_back(t.compile);
+        passesUs.push_back(t.passes);
+        assembleUs.push_back(t.assemble);
+    }
+    *times = CompileTimes{median(optimizeUs), median(compileUs), median(passesUs),
+                          median(assembleUs)};
+    return is;
+}
+
+// Median rows/sec of 'runPass', which runs every row once. Passes are repeated in
+// each trial so it takes about kPassTime.
+template <typename RunPass>
+double rowsPerSecond(RunPass runPass) {
+    runPass();
+    auto start = Clock::now();
+    runPass();
+    auto once = Clock::now() - start;
+    size_t passes = std::max<size_t>(1, kPassTime / std::max(once, Clock::duration(1)));
+
+    std::vector<double> trials;
+    for (size_t t = 0; t < kTrials; ++t) {
+        auto start = Clock::now();
+        for (size_t p = 0; p < passes; ++p) {
+            runPass();
+        }
+        auto secs = std::chrono::duration<double>(Clock::now() - start).count();
+        trials.push_back(double(passes * kBatchSize) / secs);
+    }
+    return median(trials);
+}
+
+// Checksums start from this rather than 0, which results of all zeros would never
+// move away from.
+const uint64_t kChecksumStart = 0xcbf29ce484222325ull;
+
+uint64_t hashResult(uint64_t h, ValTagOwned v) {
+    h ^= uint64_t(v.val) + uint64_t(v.tag) * 0x9e3779b97f4a7c15ull;
+    return h * 0xbf58476d1ce4e5b9ull;
+}
+
+// Runs one case and prints its line. Returns false if the results of the ways of
+// running it disagree.
+bool runCase(ExprShape shape, size_t size, uint64_t seed) {
+    CompileTimes times;
+    auto reps = std::clamp<size_t>(2048 / size, 5, 64);
+    CompiledProgram program(compileCase(shape, size, seed, reps, &times));
+
+    // The rows come from their own generator, so they're the same for every shape.
+    ExprGenerator rowGen(seed ^ 0x726f7773, kNumSlots);
+    std::vector<ValTagOwned> rows;
+    for (size_t i = 0; i < kBatchSize; ++i) {
+        auto row = rowGen.makeRow();
+        rows.insert(rows.end(), row.begin(), row.end());
+    }
+    std::vector<RegisterValue> table;
+    std::vector<std::vector<RegisterValue>> columns(kNumSlots);
+    for (size_t i = 0; i < rows.size(); ++i) {
+        table.push_back(toRegister(rows[i]));
+        columns[i % kNumSlots].push_back(table.back());
+    }
+
+    ExecFrame frame(&program);
+    std::vector<ValTagOwned> results(kBatchSize);
+    auto rowPerSec = rowsPerSecond([&] {
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            frame.bindSlots(table.data() + i * kNumSlots);
+            frame.run();
+            results[i] = frame.result();
+        }
+    });
+    uint64_t checksum = kChecksumStart;
+    for (const auto& r : results) {
+        checksum = hashResult(checksum, r);
+    }
+
+    BatchRuntime batch(&program);
+    for (SlotId s = 0; s < kNumSlots; ++s) {
+        batch.bindSlot(s, columns[s].data());
+    }
+    auto batchPerSec = rowsPerSecond([&] {
+        batch.run(kBatchSize);
+    });
+    bool agree = true;
+    for (size_t i = 0; i < kBatchSize; ++i) {
+        auto r = batch.result(i);
+        agree = agree && r.tag == results[i].tag && r.val == results[i].val;
+    }
+
+    // Threshold of 1 so the first run compiles.
+    TieredProgram tiered(&program, 1);
+    ExecFrame nativeFrame(&program);
+    nativeFrame.bindSlots(table.data());
+    tiered.run(&nativeFrame);
+    double nativePerSec = 0;
+    if (tiered.isNative()) {
+        nativePerSec = rowsPerSecond([&] {
+            for (size_t i = 0; i < kBatchSize; ++i) {
+                nativeFrame.bindSlots(table.data() + i * kNumSlots);
+                tiered.run(&nativeFrame);
+                results[i] = nativeFrame.result();
+            }
+        });
+        uint64_t nativeChecksum = kChecksumStart;
+        for (const auto& r : results) {
+            nativeChecksum = hashResult(nativeChecksum, r);
+        }
+        agree = agree && nativeChecksum == checksum;
+    }
+
+    std::cout << exprShapeName(shape) << "," << size << "," << seed << "," <<
+        (EXEC_PACKED_VALUES ? "packed" : "unpacked") << "," <<
+        program.instructions.size() << "," << program.numRegisters << "," <<
+        times.optimize << "," << times.compile << "," << times.passes << "," <<
+        times.assemble << "," <<
+        times.optimize + times.compile + times.passes + times.assemble << "," <<
+        rowPerSec << "," << batchPerSec << "," << nativePerSec << "," << checksum << "\n";
+    if (!agree) {
+        std::cerr << exprShapeName(shape) << " " << size << ": results differ\n";
+    }
+    return agree;
+}
+
+int main(int argc, char** argv) {
+    uint64_t seed = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1;
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "shape,size,seed,values,code_bytes,registers,optimize_us,compile_us," <<
+        "passes_us,assemble_us,total_us,rows_per_sec,batch_rows_per_sec," <<
+        "native_rows_per_sec,checksum\n";
+    bool ok = true;
+    for (auto shape : kExprShapes) {
+        for (size_t size : {16, 256, 4096}) {
+            ok = runCase(shape, size, seed) && ok;
+        }
+    }
+    return ok ? 0 : 1;
+}
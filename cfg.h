@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <span>
+#include <sstream>
+
+#include "instructions.h"
+
+const size_t kNoBlock = ~size_t(0);
+
+// Returns whether 'instr' is one of the tests which conditionally run the jmp
+// following them.
+bool isTest(const LInstr& instr) {
+    return std::holds_alternative<LInstrTestTruthy>(instr) ||
+        std::holds_alternative<LInstrTestFalsey>(instr) ||
+        std::holds_alternative<LInstrTestNothing>(instr);
+}
+
+struct BasicBlock {
+    // The block is instructions [begin, end) of the CompilationResult. A block
+    // which branches ends with a jmp, or a test followed by a jmp.
+    size_t begin = 0;
+    size_t end = 0;
+
+    // A block has at most two successors. For a conditional branch the jump target
+    // comes first, then the fall through.
+    size_t succs[2] = {kNoBlock, kNoBlock};
+    size_t numSuccs = 0;
+
+    // Immediate dominator. kNoBlock for the entry block, and for blocks which can't
+    // be reached.
+    size_t idom = kNoBlock;
+};
+
+// Basic blocks of a CompilationResult. The instructions aren't copied, so the graph
+// is only valid until they are next modified.
+//
+// We only ever jump forward, so every edge goes from a block to a later one and
+// the blocks are already in topological order. That lets us compute dominators in
+// a single pass.
+//
+// Predecessors and dominator tree children are variable length, so they're kept in
+// one flat list each, with the entries for block b in [start[b], start[b + 1]).
+struct ControlFlowGraph {
+    ControlFlowGraph(const CompilationResult& r) {
+        const auto& instrs = r.instructions;
+        blockOfInstr.resize(instrs.size());
+
+        // Every label starts a block, and so does whatever follows a jmp.
+        for (size_t i = 0; i < instrs.size(); ++i) {
+            bool leader = i == 0 || std::holds_alternative<LInstrLabel>(instrs[i]) ||
+                std::holds_alternative<LInstrJmp>(instrs[i - 1]);
+            if (leader) {
+                if (!blocks.empty()) {
+                    blocks.back().end = i;
+                }
+                blocks.push_back(BasicBlock{i, i});
+            }
+            if (auto l = getAlternative<LInstrLabel>(instrs[i])) {
+                if (l->label >= labelBlocks.size()) {
+                    labelBlocks.resize(l->label + 1, kNoBlock);
+                }
+                labelBlocks[l->label] = blocks.size() - 1;
+            }
+            blockOfInstr[i] = blocks.size() - 1;
+        }
+        if (!blocks.empty()) {
+            blocks.back().end = instrs.size();
+        }
+
+        predStart.assign(blocks.size() + 1, 0);
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            auto& block = blocks[b];
+            auto last = block.end - 1;
+            bool fallsThrough = true;
+            if (auto jmp = getAlternative<LInstrJmp>(instrs[last])) {
+                assert(jmp->label < labelBlocks.size() && labelBlocks[jmp->label] != kNoBlock);
+                block.succs[block.numSuccs++] = labelBlocks[jmp->label];
+                fallsThrough = last > block.begin && isTest(instrs[last - 1]);
+            } else {
+                // Tests are always followed by their jmp.
+                assert(!isTest(instrs[last]));
+            }
+            if (fallsThrough && b + 1 < blocks.size() &&
+                (block.numSuccs == 0 || block.succs[0] != b + 1)) {
+                block.succs[block.numSuccs++] = b + 1;
+            }
+            for (auto s : succs(b)) {
+                assert(s > b);
+                ++predStart[s + 1];
+            }
+        }
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            predStart[b + 1] += predStart[b];
+        }
+        predList.resize(predStart.back());
+        std::vector<size_t> fill(predStart.begin(), predStart.end() - 1);
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            for (auto s : succs(b)) {
+                predList[fill[s]++] = b;
+            }
+        }
+
+        computeDominators();
+    }
+
+    // Whether every path from the entry to 'b' goes through 'a'. Blocks dominate
+    // themselves.
+    bool dominates(size_t a, size_t b) const {
+        if (!isReachable(a) || !isReachable(b)) {
+            return false;
+        }
+        return preorder[a] <= preorder[b] && postorder[b] <= postorder[a];
+    }
+
+    std::span<const size_t> succs(size_t b) const {
+        return {blocks[b].succs, blocks[b].numSuccs};
+    }
+    std::span<const size_t> preds(size_t b) const {
+        return {predList.data() + predStart[b], predStart[b + 1] - predStart[b]};
+    }
+    std::span<const size_t> domChildren(size_t b) const {
+        return {childList.data() + childStart[b], childStart[b + 1] - childStart[b]};
+    }
+
+    bool isReachable(size_t b) const {
+        return b == 0 || blocks[b].idom != kNoBlock;
+    }
+
+    std::string print() const {
+        std::stringstream out;
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            const auto& block = blocks[b];
+            out << "B" << b << " [" << block.begin << ", " << block.end << ") succs";
+            for (auto s : succs(b)) {
+                out << " B" << s;
+            }
+            if (block.idom != kNoBlock) {
+                out << " idom B" << block.idom;
+            }
+            out << "\n";
+        }
+        return out.str();
+    }
+
+    std::vector<BasicBlock> blocks;
+    // Indexed by instruction.
+    std::vector<size_t> blockOfInstr;
+
+    // Indexed by LabelId.
+    std::vector<size_t> labelBlocks;
+
+    std::vector<size_t> predStart;
+    std::vector<size_t> predList;
+    std::vector<size_t> childStart;
+    std::vector<size_t> childList;
+
+    // Numbering of the blocks in a depth first walk of the dominator tree, so
+    // dominance can be checked without walking up the tree.
+    std::vector<size_t> preorder;
+    std::vector<size_t> postorder;
+
+private:
+    void computeDominators() {
+        // Since blocks are in topological order, all of the predecessors of a block
+        // are done by the time we get to it, and its immediate dominator is their
+        // nearest common ancestor in the dominator tree. Blocks with thousands of
+        // predecessors are common (every operand of an and jumps to the end), so the
+        // ancestor queries use skew binary jump pointers to take O(log n) steps
+        // rather than walking up one block at a time.
+        std::vector<size_t> depth(blocks.size(), 0);
+        std::vector<size_t> jump(blocks.size(), 0);
+        auto parent = [&](size_t b) {
+            return b == 0 ? 0 : blocks[b].idom;
+        };
+        auto commonDominator = [&](size_t a, size_t b) {
+            if (depth[a] < depth[b]) {
+                std::swap(a, b);
+            }
+            while (depth[a] > depth[b]) {
+                a = depth[jump[a]] >= depth[b] ? jump[a] : parent(a);
+            }
+            while (a != b) {
+                if (jump[a] != jump[b]) {
+                    a = jump[a];
+                    b = jump[b];
+                } else {
+                    a = parent(a);
+                    b = parent(b);
+                }
+            }
+            return a;
+        };
+        for (size_t b = 1; b < blocks.size(); ++b) {
+            size_t idom = kNoBlock;
+            for (auto p : preds(b)) {
+                if (!isReachable(p)) {
+                    continue;
+                }
+                idom = idom == kNoBlock ? p : commonDominator(idom, p);
+            }
+            blocks[b].idom = idom;
+            if (idom == kNoBlock) {
+                continue;
+            }
+            depth[b] = depth[idom] + 1;
+            auto j = jump[idom];
+            jump[b] = depth[idom] - depth[j] == depth[j] - depth[jump[j]] ? jump[j] : idom;
+        }
+
+        // Blocks are visited in order, so each block's children come out sorted.
+        childStart.assign(blocks.size() + 1, 0);
+        for (size_t b = 1; b < blocks.size(); ++b) {
+            if (blocks[b].idom != kNoBlock) {
+                ++childStart[blocks[b].idom + 1];
+            }
+        }
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            childStart[b + 1] += childStart[b];
+        }
+        childList.resize(childStart.back());
+        std::vector<size_t> fill(childStart.begin(), childStart.end() - 1);
+        for (size_t b = 1; b < blocks.size(); ++b) {
+            if (blocks[b].idom != kNoBlock) {
+                childList[fill[blocks[b].idom]++] = b;
+            }
+        }
+
+        preorder.assign(blocks.size(), 0);
+        postorder.assign(blocks.size(), 0);
+        if (blocks.empty()) {
+            return;
+        }
+        size_t pre = 0;
+        size_t post = 0;
+        // (block, index of the next child to visit)
+        std::vector<std::pair<size_t, size_t>> stack{{0, 0}};
+        preorder[0] = pre++;
+        while (!stack.empty()) {
+            auto& [b, child] = stack.back();
+            if (child < domChildren(b).size()) {
+                auto c = domChildren(b)[child++];
+                preorder[c] = pre++;
+                stack.push_back({c, 0});
+            } else {
+                postorder[b] = post++;
+                stack.pop_back();
+            }
+        }
+    }
+};
+
+// Calls f(pred, k) for every incoming edge of 'phi', which is in block 'b', with
+// the index of the source it brings in. The predecessors and the boundaries are
+// both in program order, so a single walk over both matches them up.
+template <typename F>
+void forEachPhiEdge(const ControlFlowGraph& cfg, size_t b, const LInstrMovePhi& phi, F f) {
+    assert(phi.boundaries.size() + 1 == phi.sources.size());
+    size_t region = 0;
+    for (auto p : cfg.preds(b)) {
+        while (region < phi.boundaries.size() &&
+               cfg.labelBlocks[phi.boundaries[region]] <= p) {
+            ++region;
+        }
+        f(p, region);
+    }
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <chrono>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "expression.h"
+#include "analysis.h"
+#include "optimize.h"
+#include "assembler.h"
+#include "exec.h"
+
+struct CompileOptions {
+    // Fold constants and simplify the expression before compiling it.
+    bool simplify = true;
+    // Rounds each optimization pipeline may run, see PassPipeline. 0 leaves the
+    // instructions as the expression emitted them.
+    size_t maxIterations = 4;
+    AssembleOptions assemble;
+    // ExpressionParam k reads slot paramSlotBase + k.
+    SlotId paramSlotBase = 0;
+};
+
+// Where compile() sends a dump of the program after each stage. A sink is any type
+// with a static constexpr bool kEnabled and the members
+//
+//   void stageDone(std::string_view stage)
+//   void trace(std::string_view stage, const std::string& text)
+//
+// stageDone() is called as each stage finishes. trace() gets a dump of the program
+// after most stages, and of other things, like the constraints, in between. The
+// text is only built when kEnabled is true, so with a disabled sink, like the
+// default NoTrace, tracing compiles to nothing.
+struct NoTrace {
+    static constexpr bool kEnabled = false;
+
+    void stageDone(std::string_view) {
+    }
+    void trace(std::string_view, const std::string&) {
+    }
+};
+
+// Writes every stage to a stream, under its name.
+struct StreamTrace {
+    static constexpr bool kEnabled = true;
+
+    StreamTrace(std::ostream& o)
+        : out(o) {
+    }
+
+    void stageDone(std::string_view) {
+    }
+    void trace(std::string_view stage, const std::string& text) {
+        out << stage << ":\n" << text << "\n";
+    }
+
+    std::ostream& out;
+};
+
+// Times each stage, from the end of the one before it, or for the first, from when
+// the sink was made. It builds no text, so dumping takes none of the time.
+struct TimingTrace {
+    using Clock = std::chrono::steady_clock;
+    static constexpr bool kEnabled = false;
+
+    TimingTrace()
+        : last(Clock::now()) {
+        stages.reserve(8);
+    }
+
+    void stageDone(std::string_view stage) {
+        auto now = Clock::now();
+        stages.emplace_back(stage, now - last);
+        last = now;
+    }
+    void trace(std::string_view, const std::string&) {
+    }
+
+    // In the order they finished.
+    std::vector<std::pair<std::string_view, Clock::duration>> stages;
+    Clock::time_point last;
+};
+
+// Calls makeText() and passes what it returns to 'trace', if that is enabled.
+template <typename Trace, typename MakeText>
+void traceText(Trace& trace, std::string_view name, MakeText makeText) {
+    if constexpr (Trace::kEnabled) {
+        trace.trace(name, makeText());
+    }
+}
+
+// Tells 'trace' that 'stage' is done, then traces its text.
+template <typename Trace, typename MakeText>
+void traceStage(Trace& trace, std::string_view stage, MakeText makeText) {
+    trace.stageDone(stage);
+    traceText(trace, stage, makeText);
+}
+
+// Compiles 'expr' down to bytecode, ready to become a CompiledProgram.
+template <typename Trace>
+ExecInstructions compileInstructions(OwnedExpression expr,
+                                     const CompileOptions& opts,
+                                     Trace& trace) {
+    if (opts.simplify) {
+        expr = expr->optimize(std::move(expr));
+    }
+    // Expressions can't be printed, so there is no text for this one.
+    trace.stageDone("simplified");
+    CompileCtx ctx;
+    ctx.paramSlotBase = opts.paramSlotBase;
+    auto res = expr->compile(&ctx);
+    traceStage(trace, "compiled", [&] {
+        return res.print();
+    });
+    traceText(trace, "constraints", [&] {
+        auto constraints = computeConstraints(res);
+        std::stringstream out;
+        for (TempId tempId = 0; tempId < constraints.size(); ++tempId) {
+            out << tmpStr(tempId) << " " << constraints[tempId].print() << "\n";
+        }
+        return out.str();
+    });
+
+    OptimizationCtx optCtx;
+    optCtx.maxIterations = opts.maxIterations;
+    optimizePreSSA(&optCtx, &res);
+    traceStage(trace, "optimized", [&] {
+        return res.print();
+    });
+    removePhi(&res);
+    traceStage(trace, "phis removed", [&] {
+        return res.print();
+    });
+    optimizePostSSA(&optCtx, &res);
+    traceStage(trace, "post ssa optimized", [&] {
+        return res.print();
+    });
+    traceText(trace, "optimization passes", [&] {
+        std::string out;
+        for (const auto& stats : optCtx.pipelineStats) {
+            out += stats.print();
+        }
+        return out;
+    });
+
+    auto is = assemble(&res, opts.assemble);
+    traceStage(trace, "assembled", [&] {
+        return is.print();
+    });
+    return is;
+}
+
+ExecInstructions compileInstructions(OwnedExpression expr, const CompileOptions& opts = {}) {
+    NoTrace trace;
+    return compileInstructions(std::move(expr), opts, trace);
+}
+
+template <typename Trace>
+CompiledProgram compile(OwnedExpression expr, const CompileOptions& opts, Trace& trace) {
+    return CompiledProgram(compileInstructions(std::move(expr), opts, trace));
+}
+
+CompiledProgram compile(OwnedExpression expr, const CompileOptions& opts = {}) {
+    return CompiledProgram(compileInstructions(std::move(expr), opts));
+}
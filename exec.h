@@ -1,149 +1,539 @@
 #pragma once
 
+#include <algorithm>
+#include <span>
+
 #include "value.h"
 #include "assembler.h"
+#include "profile.h"
+
+// Threaded dispatch uses the "labels as values" extension (gcc, clang). Define
+// EXEC_NO_COMPUTED_GOTO to build with the plain switch loop only.
+#if defined(__GNUC__) && !defined(EXEC_NO_COMPUTED_GOTO)
+#define EXEC_HAS_COMPUTED_GOTO 1
+#else
+#define EXEC_HAS_COMPUTED_GOTO 0
+#endif
+
+// gcc merges the indirect jumps at the end of each handler back into one unless told
+// not to, which defeats the point of threading the dispatch.
+#if EXEC_HAS_COMPUTED_GOTO && !defined(__clang__)
+#define EXEC_INTERPRETER_ATTRIBUTES __attribute__((optimize("no-gcse", "no-crossjumping")))
+#else
+#define EXEC_INTERPRETER_ATTRIBUTES
+#endif
 
-struct Function {
-    // Total number of local variables.
-    int maxStackSize = 0;
+enum class Dispatch {
+    // One indirect branch at the top of the loop shared by all instructions.
+    kSwitch,
+    // Every handler jumps straight to the next handler, so each one gets its own
+    // indirect branch (and its own branch predictor history).
+    kThreaded,
 };
 
-struct Runtime {
-    Runtime(Function fnInfo,
-            std::vector<char> is,
-            std::vector<ValTagOwned> st):
-        currentFunction(fnInfo),
-        instructions(std::move(is)),
-        stack(std::move(st)) {
-        base = st.size();
+constexpr Dispatch kDefaultDispatch =
+    EXEC_HAS_COMPUTED_GOTO ? Dispatch::kThreaded : Dispatch::kSwitch;
 
-        assert(instructions.size() % 4 == 0);
+#if EXEC_HAS_COMPUTED_GOTO
+#define EXEC_CASE(op) case op: L_##op:
+#define EXEC_THREADED_JUMP()                                      \
+    if constexpr (dispatch == Dispatch::kThreaded) {              \
+        goto* kDispatchTable[uint8_t(*eip)];                      \
     }
+#else
+#define EXEC_CASE(op) case op:
+#define EXEC_THREADED_JUMP()
+#endif
 
-    void run() {
-        // TODO: Should maybe put 'base' in a local variable? Check asm output.
-        stack.resize(base + currentFunction.maxStackSize);
+#if EXEC_PROFILE
+#define EXEC_PROFILE_ENTER()                    \
+    if (profile) {                              \
+        profile->enter(eip - code);             \
+    }
+#define EXEC_PROFILE_BRANCH(taken)              \
+    if (profile) {                              \
+        profile->branch(eip - code, taken);     \
+    }
+#define EXEC_PROFILE_EXIT()                     \
+    if (profile) {                              \
+        profile->exit();                        \
+    }
+#else
+#define EXEC_PROFILE_ENTER()
+#define EXEC_PROFILE_BRANCH(taken)
+#define EXEC_PROFILE_EXIT()
+#endif
+
+// Moves to the next instruction. In threaded mode this jumps directly to its
+// handler, otherwise it goes back around the switch loop.
+#define EXEC_NEXT()                             \
+    eip += kInstructionSize;                    \
+    if (eip == end) {                           \
+        EXEC_PROFILE_EXIT()                     \
+        return;                                 \
+    }                                           \
+    EXEC_PROFILE_ENTER()                        \
+    EXEC_THREADED_JUMP()                        \
+    continue;
+
+#if EXEC_PACKED_VALUES
+inline PackedValue addValues(PackedValue l, PackedValue r) {
+    if (isNothing(l) || isNothing(r)) {
+        return PackedValue{kTagNothing};
+    }
+    if (!((l.bits | r.bits) & kPackedBoxed)) {
+        // Add the payloads in place, which wraps at 56 bits.
+        const uint64_t mask = ~(kPackedTagMask | kPackedBoxed);
+        return PackedValue{((l.bits & mask) + (r.bits & mask)) | kTagInt};
+    }
+    auto sum = fromRegister(l).val + fromRegister(r).val;
+    return PackedValue{(sum << kPackedPayloadShift) | kTagInt};
+}
+#else
+inline ValTagOwned addValues(const ValTagOwned& l, const ValTagOwned& r) {
+    if (l.tag == kTagNothing || r.tag == kTagNothing) {
+        return makeNothing();
+    }
+    return ValTagOwned{l.val + r.val, kTagInt};
+}
+#endif
+
+// For operands which are known to be inline and not Nothing, so none of the checks
+// in addValues() are needed.
+#if EXEC_PACKED_VALUES
+inline PackedValue addInts(PackedValue l, PackedValue r) {
+    return PackedValue{((l.bits & ~kPackedTagMask) + (r.bits & ~kPackedTagMask)) | kTagInt};
+}
+// Only looks at the inline payload, so the value mustn't be boxed.
+inline bool isTruthyUnboxed(PackedValue p) {
+    return (p.bits >> kPackedPayloadShift) != 0;
+}
+#else
+inline ValTagOwned addInts(const ValTagOwned& l, const ValTagOwned& r) {
+    return ValTagOwned{l.val + r.val, kTagInt};
+}
+inline bool isTruthyUnboxed(const ValTagOwned& v) {
+    return v.val != 0;
+}
+#endif
+
+inline const RegisterValue& fillEmptyValue(const RegisterValue& v, const RegisterValue& fill) {
+    return isNothing(v) ? fill : v;
+}
+
+// Runs the bytecode in [code, end). Registers, constants and slots are passed
+// separately so the same loop can be used regardless of where they live. 'profile'
+// is only used in EXEC_PROFILE builds, and may be null.
+template <Dispatch dispatch>
+EXEC_INTERPRETER_ATTRIBUTES
+void interpret(const char* code,
+               const char* end,
+               const RegisterValue* constants,
+               const RegisterValue* slots,
+               RegisterValue* stackBase,
+               [[maybe_unused]] ExecProfile* profile) {
+#if EXEC_HAS_COMPUTED_GOTO
+    // Must be kept in the same order as InstrCode.
+    static const void* const kDispatchTable[] = {
+        &&L_kLoadConst,
+        &&L_kLoadSlot,
+        &&L_kMove,
+        &&L_kAdd,
+        &&L_kEq,
+        &&L_kFillEmpty,
+        &&L_kTestEq,
+        &&L_kTestTruthy,
+        &&L_kTestFalsey,
+        &&L_kJmp,
+        &&L_kTestNothing,
+        &&L_kJmpIfTruthy,
+        &&L_kJmpIfFalsey,
+        &&L_kJmpIfNothing,
+        &&L_kAddConst,
+        &&L_kLoadImmInt,
+        &&L_kLoadImmTag,
+        &&L_kAddImm,
+        &&L_kAddInt,
+        &&L_kJmpIfTrue,
+        &&L_kJmpIfFalse,
+        &&L_kWide,
+    };
+    static_assert(sizeof(kDispatchTable) / sizeof(kDispatchTable[0]) == kWide + 1);
+#endif
+
+    const char* eip = code;
+    if (eip == end) {
+        EXEC_PROFILE_EXIT()
+        return;
+    }
+    EXEC_PROFILE_ENTER()
+    EXEC_THREADED_JUMP()
 
-        const char* eip = instructions.data() - kInstructionSize;
-        const char* end = instructions.data() + instructions.size();
-        auto* stackBase = &stack[base];
-        while (true) {
+    while (true) {
+        assert(uintptr_t(eip - code) % 4 == 0);
+        assert(eip < end);
+        switch(*(InstrCode*)eip) {
+        EXEC_CASE(kLoadConst) {
+            uint8_t regId = *(eip + 1);
+            auto constId = readFromMemory<uint16_t>(eip + 2);
+            stackBase[regId] = constants[constId];
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kLoadSlot) {
+            uint8_t regId = *(eip + 1);
+            auto slotId = readFromMemory<uint16_t>(eip + 2);
+            stackBase[regId] = slots[slotId];
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kMove) {
+            uint8_t dstId = *(eip + 1);
+            uint8_t srcId = *(eip + 2);
+            stackBase[dstId] = stackBase[srcId];
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kAdd) {
+            uint8_t dstReg = *(eip + 1);
+            uint8_t leftReg = *(eip + 2);
+            uint8_t rightReg = *(eip + 3);
+            stackBase[dstReg] = addValues(stackBase[leftReg], stackBase[rightReg]);
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kFillEmpty) {
+            uint8_t dstReg = *(eip + 1);
+            uint8_t valReg = *(eip + 2);
+            uint8_t rightReg = *(eip + 3);
+            stackBase[dstReg] = fillEmptyValue(stackBase[valReg], stackBase[rightReg]);
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kEq) {
+            assert(0);
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kJmp) {
+            auto offId = readFromMemory<uint16_t>(eip + 2 /* skip padding */);
+            eip += offId;
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kTestEq) {
+            uint8_t l = *(eip + 1);
+            uint8_t r = *(eip + 2);
+            bool testPasses = valuesEqual(stackBase[l], stackBase[r]);
+            EXEC_PROFILE_BRANCH(testPasses)
             eip += kInstructionSize;
-            if (eip == end) {
-                break;
-            }
-            assert(uintptr_t(eip - instructions.data()) % 4 == 0);
-            assert(eip < end);
-            InstrCode instrCode = *(InstrCode*)eip;
-            switch(instrCode) {
-            case kLoadConst: {
-                auto regId = *(eip + 1);
-                auto constId = readFromMemory<uint16_t>(eip + 2);
-                stackBase[regId] = stack[constId];
-                continue;
+            if (testPasses) {
+                // Execute the following jmp instruction right here.
+                assert(*eip == kJmp);
+                auto offId = readFromMemory<uint16_t>(eip + 2);
+                eip += offId;
             }
-            case kLoadSlot: {
-                auto regId = *(eip + 1);
-                auto constId = readFromMemory<uint16_t>(eip + 2);
-                SlotAccessor* slot = (SlotAccessor*)stack[constId].val;
-                stackBase[regId] = slot->data;
-                continue;
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kTestTruthy) {
+            uint8_t v = *(eip + 1);
+            // TODO: This probably has to be nicer when we do it for real.
+            bool testPasses = isTruthy(stackBase[v]);
+            EXEC_PROFILE_BRANCH(testPasses)
+            eip += kInstructionSize;
+            if (testPasses) {
+                assert(*eip == kJmp);
+                auto offId = readFromMemory<uint16_t>(eip + 2);
+                eip += offId;
             }
-            case kMove: {
-                auto dstId = *(eip + 1);
-                auto srcId = *(eip + 2);
-                stackBase[dstId] = stackBase[srcId];
-                continue;
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kTestFalsey) {
+            uint8_t v = *(eip + 1);
+            // TODO: This probably has to be nicer when we do it for real.
+            bool testPasses = !isTruthy(stackBase[v]);
+            EXEC_PROFILE_BRANCH(testPasses)
+            eip += kInstructionSize;
+            if (testPasses) {
+                assert(*eip == kJmp);
+                auto offId = readFromMemory<uint16_t>(eip + 2);
+                eip += offId;
             }
-            case kAdd: {
-                auto dstReg = *(eip + 1);
-                auto leftReg = *(eip + 2);
-                auto rightReg = *(eip + 3);
-                if (stackBase[leftReg].tag == kTagNothing ||
-                    stackBase[rightReg].tag == kTagNothing) {
-                    stackBase[dstReg] = makeNothing();
-                } else {
-                    stackBase[dstReg].val =
-                        stackBase[leftReg].val + stackBase[rightReg].val;
-                }
-                continue;
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kTestNothing) {
+            uint8_t v = *(eip + 1);
+            bool testPasses = isNothing(stackBase[v]);
+            EXEC_PROFILE_BRANCH(testPasses)
+            eip += kInstructionSize;
+            if (testPasses) {
+                assert(*eip == kJmp);
+                auto offId = readFromMemory<uint16_t>(eip + 2);
+                eip += offId;
             }
-            case kFillEmpty: {
-                auto dstReg = *(eip + 1);
-                auto valReg = *(eip + 2);
-                auto rightReg = *(eip + 3);
-                if (stackBase[valReg].tag == kTagNothing) {
-                    stackBase[dstReg] = stackBase[rightReg];
-                } else {
-                    stackBase[dstReg] = stackBase[valReg];
-                }
-                continue;
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kJmpIfTruthy) {
+            uint8_t v = *(eip + 1);
+            bool taken = isTruthy(stackBase[v]);
+            EXEC_PROFILE_BRANCH(taken)
+            if (taken) {
+                eip += readFromMemory<uint16_t>(eip + 2);
             }
-            case kEq: {
-                assert(0);
-                break;
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kJmpIfFalsey) {
+            uint8_t v = *(eip + 1);
+            bool taken = !isTruthy(stackBase[v]);
+            EXEC_PROFILE_BRANCH(taken)
+            if (taken) {
+                eip += readFromMemory<uint16_t>(eip + 2);
             }
-            case kJmp: {
-                auto offId = readFromMemory<uint16_t>(eip + 2 /* skip padding */);
-                eip += offId;
-                continue;
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kJmpIfNothing) {
+            uint8_t v = *(eip + 1);
+            bool taken = isNothing(stackBase[v]);
+            EXEC_PROFILE_BRANCH(taken)
+            if (taken) {
+                eip += readFromMemory<uint16_t>(eip + 2);
             }
-            case kTestEq: {
-                auto l = *(eip + 1);
-                auto r = *(eip + 2);
-                if (stackBase[l] == stackBase[r]) {
-                    eip += kInstructionSize;
-                    // Execute the following jmp instruction right here.
-                    assert(*eip == kJmp);
-                    auto offId = readFromMemory<uint16_t>(eip + 2);
-                    eip += offId;
-                } else {
-                    eip += kInstructionSize;
-                }
-                continue;
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kAddConst) {
+            uint8_t dstReg = *(eip + 1);
+            uint8_t leftReg = *(eip + 2);
+            uint8_t constId = *(eip + 3);
+            stackBase[dstReg] = addValues(stackBase[leftReg], constants[constId]);
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kLoadImmInt) {
+            uint8_t regId = *(eip + 1);
+            auto imm = readFromMemory<int16_t>(eip + 2);
+            stackBase[regId] = makeRegister(Value(int64_t(imm)), kTagInt);
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kLoadImmTag) {
+            uint8_t regId = *(eip + 1);
+            stackBase[regId] = makeRegister(Value(uint8_t(*(eip + 3))), Tag(*(eip + 2)));
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kAddImm) {
+            uint8_t dstReg = *(eip + 1);
+            uint8_t leftReg = *(eip + 2);
+            auto imm = int8_t(*(eip + 3));
+            stackBase[dstReg] = addValues(stackBase[leftReg], makeRegister(Value(int64_t(imm)), kTagInt));
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kAddInt) {
+            uint8_t dstReg = *(eip + 1);
+            uint8_t leftReg = *(eip + 2);
+            uint8_t rightReg = *(eip + 3);
+            stackBase[dstReg] = addInts(stackBase[leftReg], stackBase[rightReg]);
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kJmpIfTrue) {
+            uint8_t v = *(eip + 1);
+            bool taken = isTruthyUnboxed(stackBase[v]);
+            EXEC_PROFILE_BRANCH(taken)
+            if (taken) {
+                eip += readFromMemory<uint16_t>(eip + 2);
             }
-            case kTestTruthy: {
-                auto v = *(eip + 1);
-                // TODO: This probably has to be nicer when we do it for real.
-                bool testPasses = (stackBase[v].val != 0);
-                if (testPasses) {
-                    eip += kInstructionSize;
-                    assert(*eip == kJmp);
-                    auto offId = readFromMemory<uint16_t>(eip + 2);
-                    eip += offId;
-                } else {
-                    eip += kInstructionSize;
-                }
-                continue;
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kJmpIfFalse) {
+            uint8_t v = *(eip + 1);
+            bool taken = !isTruthyUnboxed(stackBase[v]);
+            EXEC_PROFILE_BRANCH(taken)
+            if (taken) {
+                eip += readFromMemory<uint16_t>(eip + 2);
             }
-            case kTestFalsey: {
-                auto v = *(eip + 1);
-                // TODO: This probably has to be nicer when we do it for real.
-                bool testPasses = (stackBase[v].val == 0);
-                if (testPasses) {
-                    eip += kInstructionSize;
-                    assert(*eip == kJmp);
-                    auto offId = readFromMemory<uint16_t>(eip + 2);
-                    eip += offId;
-                } else {
-                    eip += kInstructionSize;
-                }
-                continue;
+            EXEC_NEXT();
+        }
+        EXEC_CASE(kWide) {
+            // Rare, so we don't care about decoding being a bit slower here.
+            auto d = decodeInstr(code, eip - code);
+            bool jump = false;
+            switch (d.op) {
+            case kLoadConst:
+                stackBase[d.a] = constants[d.x];
+                break;
+            case kLoadSlot:
+                stackBase[d.a] = slots[d.x];
+                break;
+            case kMove:
+                stackBase[d.a] = stackBase[d.b];
+                break;
+            case kAdd:
+                stackBase[d.a] = addValues(stackBase[d.b], stackBase[d.c]);
+                break;
+            case kFillEmpty:
+                stackBase[d.a] = fillEmptyValue(stackBase[d.b], stackBase[d.c]);
+                break;
+            case kAddConst:
+                stackBase[d.a] = addValues(stackBase[d.b], constants[d.x]);
+                break;
+            case kAddInt:
+                stackBase[d.a] = addInts(stackBase[d.b], stackBase[d.c]);
+                break;
+            case kAddImm:
+                stackBase[d.a] = addValues(stackBase[d.b], makeRegister(Value(d.x), kTagInt));
+                break;
+            case kLoadImmInt:
+                stackBase[d.a] = makeRegister(Value(d.x), kTagInt);
+                break;
+            case kLoadImmTag:
+                stackBase[d.a] = makeRegister(Value(d.x), Tag(d.b));
+                break;
+            case kJmp:
+                jump = true;
+                break;
+            case kJmpIfTruthy:
+                jump = isTruthy(stackBase[d.a]);
+                break;
+            case kJmpIfFalsey:
+                jump = !isTruthy(stackBase[d.a]);
+                break;
+            case kJmpIfNothing:
+                jump = isNothing(stackBase[d.a]);
+                break;
+            case kJmpIfTrue:
+                jump = isTruthyUnboxed(stackBase[d.a]);
+                break;
+            case kJmpIfFalse:
+                jump = !isTruthyUnboxed(stackBase[d.a]);
+                break;
+            default:
+                assert(0);
             }
+            if (isConditionalBranch(d.op)) {
+                EXEC_PROFILE_BRANCH(jump)
             }
+            // EXEC_NEXT() moves forward by one compact instruction.
+            eip = code + (jump ? d.target : (eip - code) + d.size) - kInstructionSize;
+            EXEC_NEXT();
+        }
+        }
 
-            // Should never get here, because of uses of continue in above loop.
-            assert(0);
+        // Should never get here, because every handler ends with EXEC_NEXT().
+        assert(0);
+    }
+}
+
+#undef EXEC_NEXT
+#undef EXEC_PROFILE_EXIT
+#undef EXEC_PROFILE_BRANCH
+#undef EXEC_PROFILE_ENTER
+#undef EXEC_THREADED_JUMP
+#undef EXEC_CASE
+
+// The output of compilation. It is never modified after construction, so a single
+// instance can be shared by any number of threads, each with its own ExecFrame.
+//
+// The bytecode and constants are either owned by the program or, for one loaded
+// with loadProgram(), live in memory like a mapped file which has to outlive it.
+struct CompiledProgram {
+    CompiledProgram(ExecInstructions is)
+        : ownedInstructions(std::move(is.instructions)),
+          ownedConstants(std::move(is.constants)),
+          instructions(ownedInstructions),
+          constants(ownedConstants),
+          numRegisters(is.numRegisters),
+          numSlots(is.numSlots) {
+        init();
+    }
+    CompiledProgram(std::span<const char> code,
+                    std::span<const ValTagOwned> consts,
+                    size_t numRegisters,
+                    size_t numSlots)
+        : instructions(code),
+          constants(consts),
+          numRegisters(numRegisters),
+          numSlots(numSlots) {
+        init();
+    }
+    CompiledProgram(const CompiledProgram&) = delete;
+    CompiledProgram& operator=(const CompiledProgram&) = delete;
+
+    // Bytes of memory the program owns.
+    size_t memoryUsage() const {
+        size_t bytes = sizeof(*this) + ownedInstructions.capacity() +
+            ownedConstants.capacity() * sizeof(ValTagOwned);
+#if EXEC_PACKED_VALUES
+        bytes += packedConstants.capacity() * sizeof(PackedValue);
+#endif
+        return bytes;
+    }
+
+    // The constants as the interpreter reads them.
+    const RegisterValue* registerConstants() const {
+#if EXEC_PACKED_VALUES
+        return packedConstants.data();
+#else
+        return constants.data();
+#endif
+    }
+
+private:
+    // Declared before the views of them.
+    std::vector<char> ownedInstructions;
+    std::vector<ValTagOwned> ownedConstants;
+
+public:
+    std::span<const char> instructions;
+    std::span<const ValTagOwned> constants;
+#if EXEC_PACKED_VALUES
+    std::vector<PackedValue> packedConstants;
+#endif
+    size_t numRegisters = 0;
+    size_t numSlots = 0;
+
+private:
+    void init() {
+        assert(instructions.size() % 4 == 0);
+#if EXEC_PACKED_VALUES
+        // Boxed constants point into 'constants', which is why this can't be copied.
+        for (const auto& c : constants) {
+            packedConstants.push_back(toRegister(c));
         }
+#endif
+    }
+};
+
+// Per-execution state for a CompiledProgram. The registers are allocated once up
+// front, so running the program doesn't allocate and a frame can be reused for as
+// many runs as you like.
+struct ExecFrame {
+    ExecFrame(const CompiledProgram* p)
+        : program(p),
+          registers(std::max<size_t>(p->numRegisters, 1)) {
+    }
+
+    // Makes the program read slot i from slots[i]. The table must have at least
+    // program->numSlots entries and outlive any runs. The caller can refill it
+    // between runs, or bind another one, without recompiling.
+    void bindSlots(const RegisterValue* table) {
+        slots = table;
+    }
+
+    // Collects counts for every following run into 'p', which must have been
+    // created for this program. Has no effect unless built with EXEC_PROFILE.
+    void setProfile(ExecProfile* p) {
+        assert(!p || p->executed.size() == program->instructions.size());
+        profile = p;
+    }
+
+    template <Dispatch dispatch = kDefaultDispatch>
+    void run() {
+        assert(slots || program->numSlots == 0);
+        interpret<dispatch>(program->instructions.data(),
+                            program->instructions.data() + program->instructions.size(),
+                            program->registerConstants(),
+                            slots,
+                            registers.data(),
+                            profile);
     }
 
-    ValTagOwned result() {
-        return stack[base];
+    // The result is always in register 0.
+    ValTagOwned result() const {
+        return fromRegister(registers[0]);
     }
 
-    Function currentFunction;
-    
-    std::vector<char> instructions;
-    std::vector<ValTagOwned> stack;
-    size_t base;
+    const CompiledProgram* program;
+    std::vector<RegisterValue> registers;
+    const RegisterValue* slots = nullptr;
+    ExecProfile* profile = nullptr;
 };
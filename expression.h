@@ -1,37 +1,138 @@
 #pragma once
 
-#include <map>
+#include <algorithm>
+#include <memory>
+#include <string_view>
 
 #include "value.h"
 #include "instructions.h"
 
-struct LogicalInstructions {
-    std::vector<LInstr> instructions;
-};
-
 struct CompileCtx {
     TempId tempId = 0;
-    int labelId = 0;
+    LabelId labelId = 0;
+    // ExpressionParam k reads slot paramSlotBase + k.
+    SlotId paramSlotBase = 0;
 
     TempId nextId() {
         return tempId++;
     }
 
-    std::string nextLabel() {
-        return "l" + std::to_string(labelId++);
+    LabelId nextLabel() {
+        return labelId++;
+    }
+
+    // The temp bound to 'name' by the innermost let which binds it.
+    TempId lookupVar(std::string_view name) const {
+        for (auto it = vars.rbegin(); it != vars.rend(); ++it) {
+            if (it->first == name) {
+                return it->second;
+            }
+        }
+        assert(0);
+        return 0;
+    }
+
+    template <typename T>
+    void emit(T&& instr) {
+        out->emplace_back(std::forward<T>(instr));
     }
 
-    std::map<std::string, TempId> varIds;
+    // Variables in scope, innermost last. The names point into the expression being
+    // compiled, which outlives the compile.
+    std::vector<std::pair<std::string_view, TempId>> vars;
+
+    // Every node emits into the same buffer, in program order, so nothing is
+    // copied on the way up the tree. Set up by Expression::compile().
+    std::vector<LInstr>* out = nullptr;
+    CompileArena* arena = nullptr;
 };
 
 // Expression
 struct Expression;
 using OwnedExpression = std::unique_ptr<Expression>;
+
+struct ExpressionConst;
+
+struct SimplifyCtx {
+    // The constant bound to 'name' by the innermost let which binds it, or null if
+    // that let binds it to something which isn't constant.
+    const ExpressionConst* lookupVar(std::string_view name) const {
+        for (auto it = vars.rbegin(); it != vars.rend(); ++it) {
+            if (it->first == name) {
+                return it->second;
+            }
+        }
+        return nullptr;
+    }
+
+    // Variables in scope, innermost last, like CompileCtx::vars.
+    std::vector<std::pair<std::string_view, const ExpressionConst*>> vars;
+
+    // Number of nodes which were folded away or replaced by something simpler.
+    size_t numSimplified = 0;
+};
+
+// Built by Expression::parameterize(). Two trees with the same shape only differ
+// in their constants, so they can share one compiled program, run with different
+// params.
+struct ShapeCtx {
+    void add(char kind) {
+        shape.push_back(kind);
+    }
+    void addInt(uint64_t v) {
+        shape.append((const char*)&v, sizeof(v));
+    }
+    void addName(std::string_view name) {
+        addInt(name.size());
+        shape.append(name);
+    }
+
+    // Serialized tree, with every constant replaced by a param.
+    std::string shape;
+    // The values of the params, in order.
+    std::vector<ValTagOwned> params;
+    // One past the highest slot the tree reads, which is where the params go.
+    SlotId numSlots = 0;
+};
+
 struct Expression {
-    virtual CompilationResult compile(CompileCtx*) = 0;
-    virtual OwnedExpression optimize(OwnedExpression self) {
+    // Emits the instructions computing this expression, returning the temp which
+    // holds its value.
+    virtual TempId emit(CompileCtx*) = 0;
+
+    CompilationResult compile(CompileCtx* ctx) {
+        CompilationResult res;
+        ctx->out = &res.instructions;
+        ctx->arena = res.arena.get();
+        res.tempId = emit(ctx);
+        ctx->out = nullptr;
+        ctx->arena = nullptr;
+        return res;
+    }
+
+    // Folds constants and simplifies the tree, returning what should replace it.
+    // Expressions have no side effects, so anything whose value can't be needed
+    // is simply dropped.
+    OwnedExpression optimize(OwnedExpression self) {
+        SimplifyCtx ctx;
+        return simplify(std::move(self), &ctx);
+    }
+
+    // 'self' owns this node. Children are simplified first.
+    virtual OwnedExpression simplify(OwnedExpression self, SimplifyCtx*) {
         return self;
     }
+
+    // False if the value is known never to be Nothing.
+    virtual bool canBeNothing() const {
+        return true;
+    }
+
+    // Replaces every constant with an ExpressionParam, appending the values to
+    // ctx->params and the shape of the tree to ctx->shape. 'self' owns this node.
+    // This runs after optimize(), since folding depends on the values.
+    virtual OwnedExpression parameterize(OwnedExpression self, ShapeCtx* ctx) = 0;
+
     // virtual std::string print() const = 0;
     virtual ~Expression() {
     }
@@ -41,10 +142,17 @@ struct Expression {
 struct ExpressionConst : public Expression {
     ExpressionConst(ValTagOwned c): constVal(c) {}
 
-    virtual CompilationResult compile(CompileCtx* ctx) {
+    virtual TempId emit(CompileCtx* ctx) {
         auto id = ctx->nextId();
-        return {id, {LInstrLoadConst{id, constVal}}};
+        ctx->emit(LInstrLoadConst{id, constVal});
+        return id;
     }
+
+    bool canBeNothing() const {
+        return constVal.tag == kTagNothing;
+    }
+
+    OwnedExpression parameterize(OwnedExpression self, ShapeCtx* ctx);
     // virtual std::string print() const {
     //     return "Const(" + std::to_string(constVal.tag) + ", " + std::to_string(constVal.val) + ")";
     // }
@@ -55,70 +163,137 @@ std::unique_ptr<ExpressionConst> makeConstInt(int val) {
     return std::make_unique<ExpressionConst>(ValTagOwned{Value(val), kTagInt, false});
 }
 
+// The value of 'e' if it's a constant, otherwise null.
+const ValTagOwned* getConst(const OwnedExpression& e) {
+    auto* c = dynamic_cast<const ExpressionConst*>(e.get());
+    return c ? &c->constVal : nullptr;
+}
+
 enum class BinOpType {
     kAdd,
     kAnd
 };
 
+// Emits an and of 'n' operands, where emitOperand(i) emits operand i and returns
+// its temp. Each operand but the last ends the evaluation if it's Nothing or
+// falsey, and the result is a phi of the operand which did.
+template <typename EmitOperand>
+TempId emitAnd(CompileCtx* ctx, size_t n, EmitOperand emitOperand) {
+    auto id = ctx->nextId();
+    auto endLabel = ctx->nextLabel();
+
+    std::pmr::vector<TempId> tempIds(ctx->arena);
+    std::pmr::vector<LabelId> boundaries(ctx->arena);
+    tempIds.reserve(n);
+    boundaries.reserve(n - 1);
+    for (size_t i = 0; i < n - 1; ++i) {
+        auto tempId = emitOperand(i);
+
+        // If it's nothing, we jump to the end.
+        ctx->emit(LInstrTestNothing{tempId});
+        ctx->emit(LInstrJmp{endLabel});
+
+        // If it's falsey, we jump to the end.
+        ctx->emit(LInstrTestFalsey{tempId});
+        ctx->emit(LInstrJmp{endLabel});
+
+        // Otherwise we evaluate the next one.
+        tempIds.push_back(tempId);
+        boundaries.push_back(ctx->nextLabel());
+        ctx->emit(LInstrLabel{boundaries.back()});
+    }
+
+    // Evaluate the last one. For this, there's no need to jump.
+    tempIds.push_back(emitOperand(n - 1));
+
+    ctx->emit(LInstrLabel{endLabel});
+    // Phi function
+    ctx->emit(LInstrMovePhi{id, std::move(tempIds), std::move(boundaries)});
+    return id;
+}
+
 struct ExpressionNOp : public Expression {
     ExpressionNOp(BinOpType t, std::vector<std::unique_ptr<Expression>> ins)
         :type(t),
          ins(std::move(ins))
     {}
 
-    std::unique_ptr<Expression> optimize(OwnedExpression self) {
-        if (type == BinOpType::kAnd) {
-            std::vector<OwnedExpression> newIns;
-            for (auto& c : ins) {
-                if (auto* ptr = dynamic_cast<ExpressionNOp*>(c.get()); ptr && ptr->type == type) {
-                    for (auto& node : ptr->ins) {
-                        newIns.push_back(std::move(node));
-                    }
-                } else {
-                    newIns.push_back(std::move(c));
+    std::unique_ptr<Expression> simplify(OwnedExpression self, SimplifyCtx* ctx) {
+        for (auto& c : ins) {
+            c = c->simplify(std::move(c), ctx);
+        }
+        if (type != BinOpType::kAnd) {
+            return self;
+        }
+
+        // A left leaning chain of ands gets here once per level with the whole
+        // chain so far as the first operand, so take over its operand list rather
+        // than copying it. Its operands have been folded already, apart from the last,
+        // which might not be last any more.
+        std::vector<OwnedExpression> newIns;
+        size_t foldFrom = 0;
+        for (auto& c : ins) {
+            if (auto* ptr = dynamic_cast<ExpressionNOp*>(c.get()); ptr && ptr->type == type) {
+                if (newIns.empty()) {
+                    newIns = std::move(ptr->ins);
+                    foldFrom = newIns.size() - 1;
+                    continue;
                 }
+                for (auto& node : ptr->ins) {
+                    newIns.push_back(std::move(node));
+                }
+            } else {
+                newIns.push_back(std::move(c));
             }
+        }
 
-            ins = std::move(newIns);
+        // A constant operand which is truthy just passes control on to the next
+        // one, unless it's the last. One which is falsey or Nothing always ends the
+        // evaluation with its own value, so nothing after it is needed.
+        size_t out = foldFrom;
+        for (size_t i = foldFrom; i < newIns.size(); ++i) {
+            auto* c = getConst(newIns[i]);
+            bool isLast = i + 1 == newIns.size();
+            if (c && !isLast && !isConstNothing(*c) && isConstTruthy(*c)) {
+                ++ctx->numSimplified;
+                continue;
+            }
+            newIns[out++] = std::move(newIns[i]);
+            if (c && !isLast) {
+                ctx->numSimplified += newIns.size() - i - 1;
+                break;
+            }
+        }
+        newIns.resize(out);
+
+        ins = std::move(newIns);
+        if (ins.size() == 1) {
+            return std::move(ins[0]);
         }
         return self;
     }
 
-    virtual CompilationResult compile(CompileCtx* ctx) {
-        auto id = ctx->nextId();
-        CompilationResult res{id};
-        if (type == BinOpType::kAnd) {
-            auto endLabel = ctx->nextLabel();
-
-            std::vector<TempId> tempIds;
-            for (size_t i = 0; i < ins.size() - 1; ++i) {
-                auto exprRes = ins[i]->compile(ctx);
-                res.append(exprRes.instructions);
-
-                // If it's nothing, we jump to the end.
-                res.instructions.push_back(LInstrTestNothing{exprRes.tempId});
-                res.instructions.push_back(LInstrJmp{endLabel});
-
-                // If it's falsey, we jump to the end.
-                res.instructions.push_back(LInstrTestFalsey{exprRes.tempId});
-                res.instructions.push_back(LInstrJmp{endLabel});
-
-                // Otherwise we evaluate the next one.
-                tempIds.push_back(exprRes.tempId);
-            }
-
-            // Evaluate the last one. For this, there's no need to jump.
-            auto lastRes = ins.back()->compile(ctx);
-            res.append(lastRes.instructions);
-            tempIds.push_back(lastRes.tempId);
+    bool canBeNothing() const {
+        return std::any_of(ins.begin(), ins.end(), [](const auto& c) {
+            return c->canBeNothing();
+        });
+    }
 
-            res.instructions.push_back(LInstrLabel{endLabel});
-            // Phi function
-            res.instructions.push_back(LInstrMovePhi{id, tempIds});
-            return res;
-        } else {
-            assert(0);
+    OwnedExpression parameterize(OwnedExpression self, ShapeCtx* ctx) {
+        ctx->add('n');
+        ctx->addInt(uint64_t(type));
+        ctx->addInt(ins.size());
+        for (auto& c : ins) {
+            c = c->parameterize(std::move(c), ctx);
         }
+        return self;
+    }
+
+    virtual TempId emit(CompileCtx* ctx) {
+        assert(type == BinOpType::kAnd);
+        return emitAnd(ctx, ins.size(), [&](size_t i) {
+            return ins[i]->emit(ctx);
+        });
     }
 
     BinOpType type;
@@ -132,39 +307,85 @@ struct ExpressionBinOp : public Expression {
         right(std::move(r)){
     }
 
-    std::unique_ptr<Expression> optimize(OwnedExpression self) {
-        left = left->optimize(std::move(left));
-        right = right->optimize(std::move(right));
-
+    std::unique_ptr<Expression> simplify(OwnedExpression self, SimplifyCtx* ctx) {
         if (type == BinOpType::kAnd) {
+            // The n ary version simplifies the operands.
             std::vector<std::unique_ptr<Expression>> children;
             children.push_back(std::move(left));
             children.push_back(std::move(right));
             auto res = std::make_unique<ExpressionNOp>(type, std::move(children));
-            return res->optimize(std::move(res));
+            return res->simplify(std::move(res), ctx);
+        }
+
+        left = left->simplify(std::move(left), ctx);
+        right = right->simplify(std::move(right), ctx);
+        if (type != BinOpType::kAdd) {
+            return self;
+        }
+
+        auto* l = getConst(left);
+        auto* r = getConst(right);
+        if (l && r) {
+            ++ctx->numSimplified;
+            return std::make_unique<ExpressionConst>(addConsts(*l, *r));
+        }
+        if ((l && isConstNothing(*l)) || (r && isConstNothing(*r))) {
+            // The other side doesn't matter.
+            ++ctx->numSimplified;
+            return std::make_unique<ExpressionConst>(makeNothing());
+        }
+
+        // Adding is commutative and associative (the result is Nothing if any
+        // operand is, and an int otherwise), so constants are moved to the right
+        // and (a + c1) + c2 becomes a + (c1 + c2).
+        if (l) {
+            std::swap(left, right);
+            std::swap(l, r);
+        }
+        if (r) {
+            auto* inner = dynamic_cast<ExpressionBinOp*>(left.get());
+            if (inner && inner->type == BinOpType::kAdd) {
+                if (auto* innerConst = getConst(inner->right)) {
+                    ++ctx->numSimplified;
+                    inner->right = std::make_unique<ExpressionConst>(addConsts(*innerConst, *r));
+                    return std::move(left);
+                }
+            }
         }
         return self;
     }
 
-    virtual CompilationResult compile(CompileCtx* ctx) {
-        auto id = ctx->nextId();
-        CompilationResult res{id};
+    bool canBeNothing() const {
+        return left->canBeNothing() || right->canBeNothing();
+    }
 
-        auto leftRes = left->compile(ctx);
-        auto rightRes = right->compile(ctx);
-        
+    OwnedExpression parameterize(OwnedExpression self, ShapeCtx* ctx) {
+        ctx->add('b');
+        ctx->addInt(uint64_t(type));
+        left = left->parameterize(std::move(left), ctx);
+        right = right->parameterize(std::move(right), ctx);
+        return self;
+    }
+
+    virtual TempId emit(CompileCtx* ctx) {
         if (type == BinOpType::kAnd) {
-            assert(0); // We always use the n ary one for compilation
-        } else if (type == BinOpType::kAdd) {
-            res.append(leftRes.instructions);
-            res.append(rightRes.instructions);
+            // simplify() turns ands into the n ary version, but it's optional.
+            return emitAnd(ctx, 2, [&](size_t i) {
+                return (i == 0 ? left : right)->emit(ctx);
+            });
+        }
 
-            res.instructions.push_back(LInstrAdd{id, leftRes.tempId, rightRes.tempId});
+        auto id = ctx->nextId();
+        auto leftId = left->emit(ctx);
+        auto rightId = right->emit(ctx);
+        
+        if (type == BinOpType::kAdd) {
+            ctx->emit(LInstrAdd{id, leftId, rightId});
         } else {
             assert(0);
         }
 
-        return res;
+        return id;
     }
 
     BinOpType type;
@@ -176,12 +397,22 @@ struct ExpressionVariable : public Expression {
     ExpressionVariable(std::string name): name(name) {
     }
 
-    virtual CompilationResult compile(CompileCtx* ctx) {
-        auto it = ctx->varIds.find(name);
-        assert(it != ctx->varIds.end());
-        CompilationResult res;
-        res.tempId = it->second;
-        return res;
+    std::unique_ptr<Expression> simplify(OwnedExpression self, SimplifyCtx* ctx) {
+        if (auto* c = ctx->lookupVar(name)) {
+            ++ctx->numSimplified;
+            return std::make_unique<ExpressionConst>(c->constVal);
+        }
+        return self;
+    }
+
+    OwnedExpression parameterize(OwnedExpression self, ShapeCtx* ctx) {
+        ctx->add('v');
+        ctx->addName(name);
+        return self;
+    }
+
+    virtual TempId emit(CompileCtx* ctx) {
+        return ctx->lookupVar(name);
     }
 
     std::string name;
@@ -191,22 +422,55 @@ std::unique_ptr<ExpressionVariable> makeVariable(std::string s) {
 }
 
 struct ExpressionSlot : public Expression {
-    ExpressionSlot(SlotAccessor* s): slot(s) {
+    ExpressionSlot(SlotId s): slot(s) {
     }
 
-    virtual CompilationResult compile(CompileCtx* ctx) {
-        CompilationResult res;
-        res.tempId = ctx->nextId();
-        res.instructions.push_back(LInstrLoadSlot{res.tempId, slot});
-        return res;
+    OwnedExpression parameterize(OwnedExpression self, ShapeCtx* ctx) {
+        ctx->add('s');
+        ctx->addInt(slot);
+        ctx->numSlots = std::max<SlotId>(ctx->numSlots, slot + 1);
+        return self;
     }
 
-    SlotAccessor* slot;
+    virtual TempId emit(CompileCtx* ctx) {
+        auto id = ctx->nextId();
+        ctx->emit(LInstrLoadSlot{id, slot});
+        return id;
+    }
+
+    SlotId slot;
 };
-std::unique_ptr<ExpressionSlot> makeSlot(SlotAccessor* s) {
+std::unique_ptr<ExpressionSlot> makeSlot(SlotId s) {
     return std::make_unique<ExpressionSlot>(s);
 }
 
+// A constant lifted out of the tree by parameterize(). Its value is passed in a
+// slot, after those the tree reads itself.
+struct ExpressionParam : public Expression {
+    ExpressionParam(size_t i): index(i) {
+    }
+
+    OwnedExpression parameterize(OwnedExpression self, ShapeCtx* ctx) {
+        // Already lifted, so its value isn't known.
+        assert(0);
+        return self;
+    }
+
+    virtual TempId emit(CompileCtx* ctx) {
+        auto id = ctx->nextId();
+        ctx->emit(LInstrLoadSlot{id, SlotId(ctx->paramSlotBase + index)});
+        return id;
+    }
+
+    size_t index;
+};
+
+OwnedExpression ExpressionConst::parameterize(OwnedExpression self, ShapeCtx* ctx) {
+    ctx->add('p');
+    ctx->params.push_back(constVal);
+    return std::make_unique<ExpressionParam>(ctx->params.size() - 1);
+}
+
 
 struct LetBind {
     LetBind(std::string n, std::unique_ptr<Expression> e):name(n), expr(std::move(e)) {}
@@ -218,34 +482,54 @@ struct LetBind {
 struct ExpressionLet : public Expression {
     ExpressionLet(std::vector<LetBind> bs, std::unique_ptr<Expression> body) :binds(std::move(bs)), body(std::move(body)) {}
 
-    std::unique_ptr<Expression> optimize(OwnedExpression self) {
+    std::unique_ptr<Expression> simplify(OwnedExpression self, SimplifyCtx* ctx) {
+        // Each bind can see the ones before it, as when compiling.
+        for (auto& b : binds) {
+            b.expr = b.expr->simplify(std::move(b.expr), ctx);
+            ctx->vars.push_back({b.name, dynamic_cast<const ExpressionConst*>(b.expr.get())});
+        }
+        body = body->simplify(std::move(body), ctx);
+        ctx->vars.resize(ctx->vars.size() - binds.size());
+
+        // Every use of a constant was replaced by a copy of it, so those binds
+        // aren't needed any more.
+        auto it = std::remove_if(binds.begin(), binds.end(), [](const LetBind& b) {
+            return getConst(b.expr) != nullptr;
+        });
+        ctx->numSimplified += binds.end() - it;
+        binds.erase(it, binds.end());
+        if (binds.empty()) {
+            return std::move(body);
+        }
+        return self;
+    }
+
+    bool canBeNothing() const {
+        return body->canBeNothing();
+    }
+
+    OwnedExpression parameterize(OwnedExpression self, ShapeCtx* ctx) {
+        ctx->add('l');
+        ctx->addInt(binds.size());
         for (auto& b : binds) {
-            b.expr = b.expr->optimize(std::move(b.expr));
+            ctx->addName(b.name);
+            b.expr = b.expr->parameterize(std::move(b.expr), ctx);
         }
-        body = body->optimize(std::move(body));
+        body = body->parameterize(std::move(body), ctx);
         return self;
     }
     
-    virtual CompilationResult compile(CompileCtx* ctx) {
-        CompilationResult res;
+    virtual TempId emit(CompileCtx* ctx) {
         // Compile the bindings
-        std::vector<TempId> bindTemps;
         for (auto& b : binds) {
-            auto bindRes = b.expr->compile(ctx);
-            res.append(bindRes.instructions);
-            bindTemps.push_back(bindRes.tempId);
-            ctx->varIds[b.name] = bindRes.tempId;
+            ctx->vars.push_back({b.name, b.expr->emit(ctx)});
         }
 
-        auto bodyRes = body->compile(ctx);
-        res.append(bodyRes.instructions);
-        res.tempId = bodyRes.tempId;
+        auto bodyId = body->emit(ctx);
 
-        for (auto& b : binds) {
-            ctx->varIds.erase(b.name);
-        }
+        ctx->vars.resize(ctx->vars.size() - binds.size());
         
-        return res;
+        return bodyId;
     }
     
     std::vector<LetBind> binds;
@@ -261,47 +545,66 @@ struct ExpressionIf : public Expression {
     {}
 
         
-    std::unique_ptr<Expression> optimize(OwnedExpression self) {
-        condition = condition->optimize(std::move(condition));
-        then = then->optimize(std::move(then));
-        els = els->optimize(std::move(els));
+    std::unique_ptr<Expression> simplify(OwnedExpression self, SimplifyCtx* ctx) {
+        condition = condition->simplify(std::move(condition), ctx);
+        if (auto* c = getConst(condition)) {
+            // Only one of the three can be the result.
+            ++ctx->numSimplified;
+            if (isConstNothing(*c)) {
+                return std::move(condition);
+            }
+            auto& taken = isConstTruthy(*c) ? then : els;
+            return taken->simplify(std::move(taken), ctx);
+        }
+        then = then->simplify(std::move(then), ctx);
+        els = els->simplify(std::move(els), ctx);
+        return self;
+    }
+
+    bool canBeNothing() const {
+        return condition->canBeNothing() || then->canBeNothing() || els->canBeNothing();
+    }
+
+    OwnedExpression parameterize(OwnedExpression self, ShapeCtx* ctx) {
+        ctx->add('i');
+        condition = condition->parameterize(std::move(condition), ctx);
+        then = then->parameterize(std::move(then), ctx);
+        els = els->parameterize(std::move(els), ctx);
         return self;
     }
 
-    virtual CompilationResult compile(CompileCtx* ctx) {
+    virtual TempId emit(CompileCtx* ctx) {
         auto id = ctx->nextId();
         
-        CompilationResult res{id};
-        auto condRes = condition->compile(ctx);
-
-        res.append(condRes.instructions);
+        auto condId = condition->emit(ctx);
 
         auto trueLabel = ctx->nextLabel();
         auto endLabel = ctx->nextLabel();
 
         // If the condition evaluates to nothing, we jump past the whole thing.
-        res.instructions.push_back(LInstrTestNothing{condRes.tempId});
-        res.instructions.push_back(LInstrJmp{endLabel});
+        ctx->emit(LInstrTestNothing{condId});
+        ctx->emit(LInstrJmp{endLabel});
 
-        res.instructions.push_back(LInstrTestTruthy{condRes.tempId});
-        res.instructions.push_back(LInstrJmp{trueLabel});
+        ctx->emit(LInstrTestTruthy{condId});
+        ctx->emit(LInstrJmp{trueLabel});
         // Compile the false branch
+        auto elseLabel = ctx->nextLabel();
+        ctx->emit(LInstrLabel{elseLabel});
 
-        auto elseRes = els->compile(ctx);
-        res.append(elseRes.instructions);
-        //res.instructions.push_back(LInstrMove{id, elseRes.tempId});
-        res.instructions.push_back(LInstrJmp{endLabel});
+        auto elseId = els->emit(ctx);
+        //ctx->emit(LInstrMove{id, elseId});
+        ctx->emit(LInstrJmp{endLabel});
         
-        res.instructions.push_back(LInstrLabel{trueLabel});
-        auto thenRes = then->compile(ctx);
-        res.append(thenRes.instructions);
-        //res.instructions.push_back(LInstrMove{id, thenRes.tempId});
-        res.instructions.push_back(LInstrLabel{endLabel});
-        res.instructions.push_back(LInstrMovePhi{id, {condRes.tempId, /* if its nothing */
-                                                          elseRes.tempId,
-                                                          thenRes.tempId}});
-
-        return res;
+        ctx->emit(LInstrLabel{trueLabel});
+        auto thenId = then->emit(ctx);
+        //ctx->emit(LInstrMove{id, thenId});
+        ctx->emit(LInstrLabel{endLabel});
+        ctx->emit(LInstrMovePhi{id,
+                std::pmr::vector<TempId>({condId, /* if its nothing */ elseId, thenId},
+                                         ctx->arena),
+                std::pmr::vector<LabelId>({elseLabel, trueLabel}, ctx->arena)});
+
+        return id;
     }
     
     std::unique_ptr<Expression> condition;
@@ -315,27 +618,54 @@ struct ExpressionCall : public Expression {
          args(std::move(args))
     {}
 
-    std::unique_ptr<Expression> optimize(OwnedExpression self) {
+    std::unique_ptr<Expression> simplify(OwnedExpression self, SimplifyCtx* ctx) {
         for (auto& arg : args) {
-            arg = arg->optimize(std::move(arg));
+            arg = arg->simplify(std::move(arg), ctx);
+        }
+        if (fnName == "fillEmpty") {
+            assert(args.size() == 2);
+            auto* fill = getConst(args[1]);
+            if (!args[0]->canBeNothing() || (fill && isConstNothing(*fill))) {
+                ++ctx->numSimplified;
+                return std::move(args[0]);
+            }
+            if (getConst(args[0])) {
+                // Must be Nothing, or the case above would have caught it.
+                ++ctx->numSimplified;
+                return std::move(args[1]);
+            }
+        }
+        return self;
+    }
+
+    bool canBeNothing() const {
+        if (fnName == "fillEmpty") {
+            return args[0]->canBeNothing() && args[1]->canBeNothing();
+        }
+        return true;
+    }
+
+    OwnedExpression parameterize(OwnedExpression self, ShapeCtx* ctx) {
+        ctx->add('c');
+        ctx->addName(fnName);
+        ctx->addInt(args.size());
+        for (auto& arg : args) {
+            arg = arg->parameterize(std::move(arg), ctx);
         }
         return self;
     }
     
-    virtual CompilationResult compile(CompileCtx* ctx) {
+    virtual TempId emit(CompileCtx* ctx) {
         auto id = ctx->nextId();
-        CompilationResult res{id};
         if (fnName == "fillEmpty") {
             assert(args.size() == 2);
-            auto leftRes = args[0]->compile(ctx);
-            auto rightRes = args[1]->compile(ctx);
-            res.append(leftRes.instructions);
-            res.append(rightRes.instructions);
-            res.instructions.push_back(LInstrFillEmpty{id, leftRes.tempId, rightRes.tempId});
+            auto leftId = args[0]->emit(ctx);
+            auto rightId = args[1]->emit(ctx);
+            ctx->emit(LInstrFillEmpty{id, leftId, rightId});
         } else {
             assert(0);
         }
-        return res;
+        return id;
     }
 
     std::string fnName;
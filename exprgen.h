@@ -0,0 +1,277 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "value.h"
+#include "expression.h"
+
+// Shapes of generated expressions. Each leans on a different part of the compiler
+// and the interpreter.
+enum class ExprShape {
+    // (a && b) && c && ..., nested to the left, with 'size' operands. Lots of
+    // branches to one place, and a phi with a source for each.
+    kAndChain,
+    // if c then (if ...) else x, 'size' ifs deep, going on down a random side at
+    // each level.
+    kNestedIf,
+    // One let with 'size' binds, each made from slots and the binds before it, so
+    // there are many variables in scope at once.
+    kWideLet,
+    // A random tree of adds with 'size' leaves, nearly all of them slots.
+    kSlotAdds,
+    // Any of the node types, mixed at random, with about 'size' nodes.
+    kMixed,
+};
+
+const ExprShape kExprShapes[] = {ExprShape::kAndChain, ExprShape::kNestedIf,
+                                 ExprShape::kWideLet, ExprShape::kSlotAdds, ExprShape::kMixed};
+
+const char* exprShapeName(ExprShape shape) {
+    switch (shape) {
+    case ExprShape::kAndChain:
+        return "and-chain";
+    case ExprShape::kNestedIf:
+        return "nested-if";
+    case ExprShape::kWideLet:
+        return "wide-let";
+    case ExprShape::kSlotAdds:
+        return "slot-adds";
+    case ExprShape::kMixed:
+        return "mixed";
+    }
+    assert(0);
+    return "";
+}
+
+// Generates expressions reading slots [0, numSlots), and rows of values for them.
+// The same seed gives the same expressions and rows everywhere, which is why this
+// has its own random numbers rather than the std distributions, whose output isn't
+// specified exactly. For the same reason, children are generated one statement at a
+// time, never as two arguments of one call, which can be evaluated in either order.
+struct ExprGenerator {
+    ExprGenerator(uint64_t seed, SlotId n = 8)
+        : state(seed),
+          numSlots(n) {
+    }
+
+    OwnedExpression generate(ExprShape shape, size_t size) {
+        assert(size > 0);
+        switch (shape) {
+        case ExprShape::kAndChain: {
+            OwnedExpression expr = operand();
+            for (size_t i = 1; i < size; ++i) {
+                expr = std::make_unique<ExpressionBinOp>(BinOpType::kAnd, std::move(expr),
+                                                         operand());
+            }
+            return expr;
+        }
+        case ExprShape::kNestedIf:
+            return nestedIf(size);
+        case ExprShape::kWideLet:
+            return wideLet(size);
+        case ExprShape::kSlotAdds:
+            return slotAdds(size);
+        case ExprShape::kMixed: {
+            std::vector<std::string> scope;
+            return mixed(size, &scope);
+        }
+        }
+        assert(0);
+        return nullptr;
+    }
+
+    // Values for every slot: mostly small ints, with some Nothing, some bools and
+    // some ints too big for a packed register, whose sums wrap differently in each
+    // value layout.
+    std::vector<ValTagOwned> makeRow() {
+        std::vector<ValTagOwned> row;
+        for (SlotId s = 0; s < numSlots; ++s) {
+            auto r = below(20);
+            if (r < 2) {
+                row.push_back(makeNothing());
+            } else if (r < 3) {
+                row.push_back(makeBool(below(2)));
+            } else if (r < 5) {
+                // Anywhere from 2^51 to 2^63 either way.
+                row.push_back(ValTagOwned{Value(int64_t(next()) >> below(12)), kTagInt});
+            } else {
+                row.push_back(makeInt(int(below(200)) - 50));
+            }
+        }
+        return row;
+    }
+
+    // splitmix64.
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [0, n). The bias is far too small to matter here.
+    size_t below(size_t n) {
+        return size_t(next() % n);
+    }
+
+private:
+    OwnedExpression slot() {
+        return makeSlot(SlotId(below(numSlots)));
+    }
+
+    OwnedExpression smallInt() {
+        return makeConstInt(int(below(20)) - 5);
+    }
+
+    // A slot, possibly with something done to it, as found in the operands of ands
+    // and the conditions of ifs.
+    OwnedExpression operand() {
+        switch (below(4)) {
+        case 0: {
+            auto s = slot();
+            return std::make_unique<ExpressionBinOp>(BinOpType::kAdd, std::move(s), smallInt());
+        }
+        case 1:
+            return makeFillEmptyFalse(slot());
+        default:
+            return slot();
+        }
+    }
+
+    OwnedExpression nestedIf(size_t depth) {
+        if (depth == 0) {
+            return below(2) ? slot() : operand();
+        }
+        auto cond = operand();
+        auto deeper = nestedIf(depth - 1);
+        auto other = below(2) ? slot() : smallInt();
+        if (below(2)) {
+            return std::make_unique<ExpressionIf>(std::move(cond), std::move(deeper),
+                                                  std::move(other));
+        }
+        return std::make_unique<ExpressionIf>(std::move(cond), std::move(other),
+                                              std::move(deeper));
+    }
+
+    OwnedExpression wideLet(size_t size) {
+        std::vector<LetBind> binds;
+        std::vector<std::string> names;
+        for (size_t i = 0; i < size; ++i) {
+            auto earlier = [&]() -> OwnedExpression {
+                if (names.empty()) {
+                    return slot();
+                }
+                return makeVariable(names[below(names.size())]);
+            };
+            OwnedExpression expr;
+            switch (below(4)) {
+            case 0:
+                expr = slot();
+                break;
+            case 1: {
+                auto l = earlier();
+                expr = std::make_unique<ExpressionBinOp>(BinOpType::kAdd, std::move(l), slot());
+                break;
+            }
+            case 2: {
+                auto l = earlier();
+                expr = std::make_unique<ExpressionBinOp>(BinOpType::kAdd, std::move(l), earlier());
+                break;
+            }
+            default:
+                expr = makeFillEmptyFalse(earlier());
+                break;
+            }
+            names.push_back(std::string("v") + std::to_string(nextVar++));
+            binds.push_back(LetBind(names.back(), std::move(expr)));
+        }
+        // Uses the last few binds, so the ones nothing depends on are dead.
+        OwnedExpression body = makeVariable(names.back());
+        for (size_t i = 1; i < std::min<size_t>(size, 8); ++i) {
+            body = std::make_unique<ExpressionBinOp>(BinOpType::kAdd, std::move(body),
+                                                     makeVariable(names[names.size() - 1 - i]));
+        }
+        return std::make_unique<ExpressionLet>(std::move(binds), std::move(body));
+    }
+
+    OwnedExpression slotAdds(size_t leaves) {
+        if (leaves == 1) {
+            return below(8) ? slot() : smallInt();
+        }
+        auto left = 1 + below(leaves - 1);
+        auto l = slotAdds(left);
+        auto r = slotAdds(leaves - left);
+        return std::make_unique<ExpressionBinOp>(BinOpType::kAdd, std::move(l), std::move(r));
+    }
+
+    OwnedExpression leaf(const std::vector<std::string>& scope) {
+        switch (below(6)) {
+        case 0:
+            return std::make_unique<ExpressionConst>(below(2) ? makeNothing() :
+                                                     makeBool(below(2)));
+        case 1:
+            return smallInt();
+        case 2:
+            if (!scope.empty()) {
+                return makeVariable(scope[below(scope.size())]);
+            }
+            return slot();
+        default:
+            return slot();
+        }
+    }
+
+    // 'size' nodes, give or take a leaf: what's left after this one is split at
+    // random between the children.
+    OwnedExpression mixed(size_t size, std::vector<std::string>* scope) {
+        if (size < 3) {
+            return leaf(*scope);
+        }
+        auto rest = size - 1;
+        auto left = 1 + below(rest - 1);
+        auto right = rest - left;
+        switch (below(5)) {
+        case 0: {
+            auto l = mixed(left, scope);
+            return std::make_unique<ExpressionBinOp>(BinOpType::kAdd, std::move(l),
+                                                     mixed(right, scope));
+        }
+        case 1: {
+            auto l = mixed(left, scope);
+            return std::make_unique<ExpressionBinOp>(BinOpType::kAnd, std::move(l),
+                                                     mixed(right, scope));
+        }
+        case 2: {
+            std::vector<OwnedExpression> args;
+            args.push_back(mixed(left, scope));
+            args.push_back(mixed(right, scope));
+            return std::make_unique<ExpressionCall>("fillEmpty", std::move(args));
+        }
+        case 3: {
+            // The condition gets 'left', and the branches share the rest.
+            auto then = (right + 1) / 2;
+            auto cond = mixed(left, scope);
+            auto t = mixed(then, scope);
+            return std::make_unique<ExpressionIf>(std::move(cond), std::move(t),
+                                                  mixed(std::max<size_t>(1, right - then),
+                                                        scope));
+        }
+        default: {
+            auto name = std::string("v") + std::to_string(nextVar++);
+            std::vector<LetBind> binds;
+            binds.push_back(LetBind(name, mixed(left, scope)));
+            scope->push_back(name);
+            auto body = mixed(right, scope);
+            scope->pop_back();
+            return std::make_unique<ExpressionLet>(std::move(binds), std::move(body));
+        }
+        }
+    }
+
+    uint64_t state;
+    SlotId numSlots;
+    // Numbers the let variables, so no name is bound twice.
+    size_t nextVar = 0;
+};
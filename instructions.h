@@ -1,15 +1,22 @@
 #pragma once
 
 #include <iostream>
+#include <memory>
+#include <memory_resource>
 #include <variant>
 #include <math.h>
 #include <vector>
 
-struct SlotAccessor;
-
 using TempId = uint32_t;
 std::string tmpStr(TempId id) {
-    return "T" + std::to_string(id);
+    return std::string("T") + std::to_string(id);
+}
+
+// Labels are numbered densely from 0 by the CompileCtx, so tables keyed by label
+// can be plain vectors.
+using LabelId = uint32_t;
+std::string labelStr(LabelId id) {
+    return std::string("l") + std::to_string(id);
 }
 
 
@@ -19,15 +26,23 @@ struct LInstrLoadConst {
 };
 struct LInstrLoadSlot {
     TempId dst;
-    SlotAccessor* slot;
+    SlotId slot;
 };
 struct LInstrMove {
     TempId dst;
     TempId src;
 };
+// Which source a phi takes depends on where control came from. The code before it
+// is split into consecutive regions, one per source, by the labels in 'boundaries':
+// sources[k] flows in along the edges leaving the code between boundaries[k - 1]
+// and boundaries[k]. The first region starts at the beginning of the program and
+// the last ends at the phi. Both vectors are allocated from the CompileArena of the
+// compilation.
 struct LInstrMovePhi {
     TempId dst;
-    std::vector<TempId> sources;
+    std::pmr::vector<TempId> sources;
+    // One fewer than there are sources.
+    std::pmr::vector<LabelId> boundaries;
 };
 struct LInstrAdd {
     TempId dst;
@@ -53,10 +68,10 @@ struct LInstrTestNothing {
     TempId reg;
 };
 struct LInstrJmp {
-    std::string labelName;
+    LabelId label;
 };
 struct LInstrLabel {
-    std::string name;
+    LabelId label;
 };
 
 using LInstr = std::variant<
@@ -73,15 +88,27 @@ using LInstr = std::variant<
     LInstrJmp
     >;
 
-struct CompilationResult {
-    TempId tempId;
-    std::vector<LInstr> instructions;
+// Bump allocator for the variable length parts of instructions, which all go away
+// together with the CompilationResult.
+using CompileArena = std::pmr::monotonic_buffer_resource;
 
-    void append(std::vector<LInstr>& moreInstructions) {
-        instructions.insert(instructions.end(),
-                            moreInstructions.begin(),
-                            moreInstructions.end());
+struct CompilationResult {
+    CompilationResult()
+        : arena(std::make_unique<CompileArena>()) {
     }
+    CompilationResult(CompilationResult&&) = default;
+    // The old instructions have to go before the arena they were allocated from.
+    CompilationResult& operator=(CompilationResult&& o) {
+        tempId = o.tempId;
+        instructions = std::move(o.instructions);
+        arena = std::move(o.arena);
+        return *this;
+    }
+
+    TempId tempId = 0;
+    // Declared before the instructions so it's destroyed after them.
+    std::unique_ptr<CompileArena> arena;
+    std::vector<LInstr> instructions;
 
     std::string print() {
         std::string out;
@@ -94,7 +121,7 @@ struct CompilationResult {
                             std::to_string(lc.constVal.tag) + ", " + std::to_string(lc.constVal.val);
                     },
                     [&](LInstrLoadSlot lc) {
-                        out += "loadslot    " + tmpStr(lc.dst) + " ";
+                        out += "loadslot    " + tmpStr(lc.dst) + " slot(" + std::to_string(lc.slot) + ")";
                     },
                     [&](LInstrAdd a) {
                         out += "add         " + tmpStr(a.dst) + " " + tmpStr(a.left) + " " +
@@ -105,21 +132,24 @@ struct CompilationResult {
                             tmpStr(a.right);
                     },
                     [&](LInstrJmp j) {
-                        out += "jmp         " + j.labelName;
+                        out += "jmp         " + labelStr(j.label);
                     },
                     [&](LInstrMove m) {
                         out += "mov         " + tmpStr(m.dst) + " " + tmpStr(m.src);
                     },
-                    [&](LInstrMovePhi m) {
+                    [&](const LInstrMovePhi& m) {
                         out += "mov         " + tmpStr(m.dst) + " phi(";
-                        for (auto& t : m.sources) {
-                            out += tmpStr(t) + ", ";
+                        for (size_t k = 0; k < m.sources.size(); ++k) {
+                            if (k > 0) {
+                                out += labelStr(m.boundaries[k - 1]) + ": ";
+                            }
+                            out += tmpStr(m.sources[k]) + ", ";
                         }
                         out.erase(out.begin() + out.size() - 2, out.end());
                         out += ")";
                     },
                     [&](LInstrLabel l) {
-                        out += l.name + ":";
+                        out += labelStr(l.label) + ":";
                     },
                     [&](LInstrTestTruthy t) {
                         out += "testt       " + tmpStr(t.reg);
@@ -139,40 +169,40 @@ struct CompilationResult {
     }
 };
 
-std::optional<TempId> getDest(LInstr instr) {
+std::optional<TempId> getDest(const LInstr& instr) {
     return std::visit(
         Overloaded{
-            [&](LInstrLoadConst lc) -> std::optional<TempId> {
+            [&](const LInstrLoadConst& lc) -> std::optional<TempId> {
                 return lc.dst;
             },
-            [&](LInstrLoadSlot lc) -> std::optional<TempId> {
+            [&](const LInstrLoadSlot& lc) -> std::optional<TempId> {
                 return lc.dst;
             },
-            [&](LInstrAdd a)  -> std::optional<TempId> {
+            [&](const LInstrAdd& a)  -> std::optional<TempId> {
                 return a.dst;
             },
-            [&](LInstrFillEmpty a)  -> std::optional<TempId> {
+            [&](const LInstrFillEmpty& a)  -> std::optional<TempId> {
                 return a.dst;
             },
-            [&](LInstrJmp j)  -> std::optional<TempId> {
+            [&](const LInstrJmp& j)  -> std::optional<TempId> {
                 return {};
             },
-            [&](LInstrMove m) -> std::optional<TempId> {
+            [&](const LInstrMove& m) -> std::optional<TempId> {
                 return m.dst;
             },
-            [&](LInstrMovePhi m) -> std::optional<TempId> {
+            [&](const LInstrMovePhi& m) -> std::optional<TempId> {
                 return m.dst;
             },
-            [&](LInstrLabel l) -> std::optional<TempId> {
+            [&](const LInstrLabel& l) -> std::optional<TempId> {
                 return {};
             },
-            [&](LInstrTestTruthy t) -> std::optional<TempId> {
+            [&](const LInstrTestTruthy& t) -> std::optional<TempId> {
                 return {};
             },
-            [&](LInstrTestFalsey t) -> std::optional<TempId> {
+            [&](const LInstrTestFalsey& t) -> std::optional<TempId> {
                 return {};
             },
-            [&](LInstrTestNothing t) -> std::optional<TempId> {
+            [&](const LInstrTestNothing& t) -> std::optional<TempId> {
                 return {};
             }
         },
@@ -181,9 +211,9 @@ std::optional<TempId> getDest(LInstr instr) {
 
 
 // After register allocation
-using Register = uint8_t;
+using Register = uint16_t;
 std::string regStr(Register r) {
-    return "R" + std::to_string(r);
+    return std::string("R") + std::to_string(r);
 }
 
 struct InstrLoadConst {
@@ -192,7 +222,7 @@ struct InstrLoadConst {
 };
 struct InstrLoadSlot {
     Register dst;
-    SlotAccessor* slot;
+    SlotId slot;
 };
 
 struct InstrMove {
@@ -229,10 +259,52 @@ struct InstrTestTruthy {
 struct InstrTestFalsey {
     Register reg;
 };
+struct InstrTestNothing {
+    Register reg;
+};
+
+// Fused forms of a test followed by a jmp. These jump by 'off' when the test passes.
+struct InstrJmpIfTruthy {
+    Register reg;
+    uint32_t off;
+};
+struct InstrJmpIfFalsey {
+    Register reg;
+    uint32_t off;
+};
+struct InstrJmpIfNothing {
+    Register reg;
+    uint32_t off;
+};
+
+// Forms which skip the checks the generic instructions make, for operands the type
+// inference has shown don't need them. AddInt's operands are never Nothing and
+// never boxed, and JmpIfTrue and JmpIfFalse test a register which is never boxed.
+struct InstrAddInt {
+    Register dst;
+    Register left;
+    Register right;
+};
+struct InstrJmpIfTrue {
+    Register reg;
+    uint32_t off;
+};
+struct InstrJmpIfFalse {
+    Register reg;
+    uint32_t off;
+};
+
+// Fused loadc + add. Either the constant is a small int, or its id has to fit in
+// one byte.
+struct InstrAddConst {
+    Register dst;
+    Register left;
+    ValTagOwned constVal;
+};
 
 
 struct InstrJmp {
-    uint16_t off;
+    uint32_t off;
 };
 
 const size_t kInstructionSize = 4;
@@ -246,5 +318,13 @@ using Instr = std::variant<
     InstrTestEq,
     InstrTestTruthy,
     InstrTestFalsey,
+    InstrTestNothing,
+    InstrJmpIfTruthy,
+    InstrJmpIfFalsey,
+    InstrJmpIfNothing,
+    InstrAddConst,
+    InstrAddInt,
+    InstrJmpIfTrue,
+    InstrJmpIfFalse,
     InstrJmp
     >;
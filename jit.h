@@ -0,0 +1,390 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <optional>
+
+#include "value.h"
+#include "exec.h"
+
+// Native code is only generated on x86-64 with mmap available, and for the default
+// 16 byte value layout. Everywhere else compileNative() fails and TieredProgram
+// keeps using the interpreter.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) && \
+    !defined(EXEC_NO_JIT) && !EXEC_PACKED_VALUES
+#define EXEC_HAS_JIT 1
+#include <sys/mman.h>
+#else
+#define EXEC_HAS_JIT 0
+#endif
+
+// Signature of generated code: (registers, constants, slots).
+using NativeFn = void (*)(RegisterValue*, const RegisterValue*, const RegisterValue*);
+
+// Executable copy of generated machine code.
+struct NativeCode {
+    NativeCode(const std::vector<uint8_t>& code) {
+#if EXEC_HAS_JIT
+        size = code.size();
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(mem != MAP_FAILED);
+        memcpy(mem, code.data(), size);
+        // Never writable and executable at the same time.
+        mprotect(mem, size, PROT_READ | PROT_EXEC);
+        fn = (NativeFn)mem;
+#endif
+    }
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+
+    ~NativeCode() {
+#if EXEC_HAS_JIT
+        munmap((void*)fn, size);
+#endif
+    }
+
+    NativeFn fn = nullptr;
+    size_t size = 0;
+};
+
+// Minimal x86-64 encoder, covering what compileNative() needs. Registers are
+// always addressed relative to rdi, constants relative to rsi and slots relative
+// to rdx, with a 32 bit displacement.
+struct X86Emitter {
+    enum Base : uint8_t {
+        kRegs = 7,   // rdi
+        kConsts = 6, // rsi
+        kSlots = 2,  // rdx
+    };
+
+    void byte(uint8_t b) {
+        code.push_back(b);
+    }
+    void imm32(int32_t v) {
+        auto pos = code.size();
+        code.resize(pos + sizeof(v));
+        writeToMemory<int32_t>((char*)code.data() + pos, v);
+    }
+    // ModRM with mod=10 (disp32).
+    void mem(uint8_t reg, Base base, int32_t disp) {
+        byte(0x80 | (reg << 3) | base);
+        imm32(disp);
+    }
+
+    void movupsLoad(Base base, int32_t disp) {  // movups xmm0, [base+disp]
+        byte(0x0F); byte(0x10); mem(0, base, disp);
+    }
+    void movupsStore(Base base, int32_t disp) {  // movups [base+disp], xmm0
+        byte(0x0F); byte(0x11); mem(0, base, disp);
+    }
+    void movRaxLoad(Base base, int32_t disp) {  // mov rax, [base+disp]
+        byte(0x48); byte(0x8B); mem(0, base, disp);
+    }
+    void movRaxStore(Base base, int32_t disp) {  // mov [base+disp], rax
+        byte(0x48); byte(0x89); mem(0, base, disp);
+    }
+    void addRax(Base base, int32_t disp) {  // add rax, [base+disp]
+        byte(0x48); byte(0x03); mem(0, base, disp);
+    }
+    void addRaxImm(int32_t v) {  // add rax, imm32
+        byte(0x48); byte(0x05); imm32(v);
+    }
+    void storeImm64(Base base, int32_t disp, int32_t v) {  // mov qword [base+disp], imm32
+        byte(0x48); byte(0xC7); mem(0, base, disp); imm32(v);
+    }
+    void cmpByte(Base base, int32_t disp, uint8_t v) {  // cmp byte [base+disp], imm8
+        byte(0x80); mem(7, base, disp); byte(v);
+    }
+    void cmpQword(Base base, int32_t disp, int8_t v) {  // cmp qword [base+disp], imm8
+        byte(0x48); byte(0x83); mem(7, base, disp); byte(uint8_t(v));
+    }
+    void movzxEaxWord(Base base, int32_t disp) {  // movzx eax, word [base+disp]
+        byte(0x0F); byte(0xB7); mem(0, base, disp);
+    }
+    void cmpAxWord(Base base, int32_t disp) {  // cmp ax, [base+disp]
+        byte(0x66); byte(0x3B); mem(0, base, disp);
+    }
+    void cmpRax(Base base, int32_t disp) {  // cmp rax, [base+disp]
+        byte(0x48); byte(0x3B); mem(0, base, disp);
+    }
+    void xorEaxEax() {
+        byte(0x31); byte(0xC0);
+    }
+    void ret() {
+        byte(0xC3);
+    }
+
+    // Jumps return the position of their rel32, to be patched once the target is
+    // known.
+    size_t jmp() {
+        byte(0xE9);
+        imm32(0);
+        return code.size() - 4;
+    }
+    size_t je() {
+        byte(0x0F); byte(0x84);
+        imm32(0);
+        return code.size() - 4;
+    }
+    size_t jne() {
+        byte(0x0F); byte(0x85);
+        imm32(0);
+        return code.size() - 4;
+    }
+    // Points the jump whose rel32 is at 'pos' to 'target'.
+    void patch(size_t pos, size_t target) {
+        writeToMemory<int32_t>((char*)code.data() + pos, int32_t(target - (pos + 4)));
+    }
+    void patchHere(size_t pos) {
+        patch(pos, code.size());
+    }
+
+    std::vector<uint8_t> code;
+};
+
+inline int32_t regOff(uint32_t r) {
+    return int32_t(r) * sizeof(ValTagOwned);
+}
+inline int32_t tagOff(uint32_t r) {
+    return regOff(r) + offsetof(ValTagOwned, tag);
+}
+static_assert(offsetof(ValTagOwned, val) == 0);
+static_assert(offsetof(ValTagOwned, owned) == offsetof(ValTagOwned, tag) + 1);
+
+// Translates the bytecode of 'program' to machine code. Every bytecode register is
+// kept in its frame slot, so generated code and the interpreter share the same
+// ExecFrame layout. Returns nothing if the program uses an instruction we don't
+// generate code for.
+std::unique_ptr<NativeCode> compileNative(const CompiledProgram& program) {
+#if EXEC_HAS_JIT
+    using B = X86Emitter::Base;
+    X86Emitter e;
+    const char* code = program.instructions.data();
+    const size_t size = program.instructions.size();
+
+    // Native offset of every bytecode offset that starts an instruction, for
+    // resolving jumps.
+    std::vector<size_t> nativeOffset(size + 1);
+    // (position of rel32, bytecode target offset)
+    std::vector<std::pair<size_t, size_t>> fixups;
+
+    std::vector<bool> isJumpTarget(size + 1);
+    for (size_t off = 0; off < size;) {
+        auto d = decodeInstr(code, off);
+        if (isJumpInstr(d.op)) {
+            isJumpTarget[d.target] = true;
+        }
+        off += d.size;
+    }
+
+    for (size_t off = 0; off < size;) {
+        nativeOffset[off] = e.code.size();
+        auto d = decodeInstr(code, off);
+        off += d.size;
+        const uint32_t a = d.a;
+        const uint32_t b = d.b;
+        const uint32_t c = d.c;
+
+        switch(d.op) {
+        case kLoadConst: {
+            e.movupsLoad(B::kConsts, d.x * sizeof(ValTagOwned));
+            e.movupsStore(B::kRegs, regOff(a));
+            break;
+        }
+        case kLoadSlot: {
+            e.movupsLoad(B::kSlots, d.x * sizeof(ValTagOwned));
+            e.movupsStore(B::kRegs, regOff(a));
+            break;
+        }
+        case kMove: {
+            e.movupsLoad(B::kRegs, regOff(b));
+            e.movupsStore(B::kRegs, regOff(a));
+            break;
+        }
+        case kAdd:
+        case kAddConst:
+        case kAddImm: {
+            std::vector<size_t> toNothing;
+            e.cmpByte(B::kRegs, tagOff(b), kTagNothing);
+            toNothing.push_back(e.je());
+            if (d.op == kAddImm) {
+                e.movRaxLoad(B::kRegs, regOff(b));
+                e.addRaxImm(int32_t(d.x));
+            } else if (d.op == kAddConst) {
+                if (program.constants[d.x].tag == kTagNothing) {
+                    toNothing.push_back(e.jmp());
+                }
+                e.movRaxLoad(B::kRegs, regOff(b));
+                e.addRax(B::kConsts, d.x * sizeof(ValTagOwned));
+            } else {
+                e.cmpByte(B::kRegs, tagOff(c), kTagNothing);
+                toNothing.push_back(e.je());
+                e.movRaxLoad(B::kRegs, regOff(b));
+                e.addRax(B::kRegs, regOff(c));
+            }
+            e.movRaxStore(B::kRegs, regOff(a));
+            // Writes the tag and clears the owned flag in one go.
+            e.storeImm64(B::kRegs, tagOff(a), kTagInt);
+            auto done = e.jmp();
+            for (auto pos : toNothing) {
+                e.patchHere(pos);
+            }
+            e.xorEaxEax();
+            e.movRaxStore(B::kRegs, regOff(a));
+            e.movRaxStore(B::kRegs, tagOff(a));
+            e.patchHere(done);
+            break;
+        }
+        case kAddInt: {
+            e.movRaxLoad(B::kRegs, regOff(b));
+            e.addRax(B::kRegs, regOff(c));
+            e.movRaxStore(B::kRegs, regOff(a));
+            e.storeImm64(B::kRegs, tagOff(a), kTagInt);
+            break;
+        }
+        case kFillEmpty: {
+            e.cmpByte(B::kRegs, tagOff(b), kTagNothing);
+            auto notNothing = e.jne();
+            e.movupsLoad(B::kRegs, regOff(c));
+            auto store = e.jmp();
+            e.patchHere(notNothing);
+            e.movupsLoad(B::kRegs, regOff(b));
+            e.patchHere(store);
+            e.movupsStore(B::kRegs, regOff(a));
+            break;
+        }
+        case kJmp: {
+            fixups.emplace_back(e.jmp(), d.target);
+            break;
+        }
+        case kTestEq:
+        case kTestTruthy:
+        case kTestFalsey:
+        case kTestNothing: {
+            // Consume the jmp following the test.
+            auto jmpOff = off;
+            auto jmp = decodeInstr(code, jmpOff);
+            assert(jmp.op == kJmp);
+            off += jmp.size;
+            if (d.op == kTestEq) {
+                e.movRaxLoad(B::kRegs, regOff(a));
+                e.cmpRax(B::kRegs, regOff(b));
+                auto differ = e.jne();
+                // Tag and owned flag compared together.
+                e.movzxEaxWord(B::kRegs, tagOff(a));
+                e.cmpAxWord(B::kRegs, tagOff(b));
+                fixups.emplace_back(e.je(), jmp.target);
+                e.patchHere(differ);
+            } else if (d.op == kTestTruthy) {
+                e.cmpQword(B::kRegs, regOff(a), 0);
+                fixups.emplace_back(e.jne(), jmp.target);
+            } else if (d.op == kTestFalsey) {
+                e.cmpQword(B::kRegs, regOff(a), 0);
+                fixups.emplace_back(e.je(), jmp.target);
+            } else {
+                e.cmpByte(B::kRegs, tagOff(a), kTagNothing);
+                fixups.emplace_back(e.je(), jmp.target);
+            }
+            if (isJumpTarget[jmpOff]) {
+                // Something jumps directly to the consumed jmp, so it needs code of
+                // its own, which the fall through path skips.
+                auto skip = e.jmp();
+                nativeOffset[jmpOff] = e.code.size();
+                fixups.emplace_back(e.jmp(), jmp.target);
+                e.patchHere(skip);
+            }
+            break;
+        }
+        case kJmpIfTruthy:
+        case kJmpIfTrue: {
+            e.cmpQword(B::kRegs, regOff(a), 0);
+            fixups.emplace_back(e.jne(), d.target);
+            break;
+        }
+        case kJmpIfFalsey:
+        case kJmpIfFalse: {
+            e.cmpQword(B::kRegs, regOff(a), 0);
+            fixups.emplace_back(e.je(), d.target);
+            break;
+        }
+        case kJmpIfNothing: {
+            e.cmpByte(B::kRegs, tagOff(a), kTagNothing);
+            fixups.emplace_back(e.je(), d.target);
+            break;
+        }
+        case kLoadImmInt: {
+            e.storeImm64(B::kRegs, regOff(a), int32_t(d.x));
+            e.storeImm64(B::kRegs, tagOff(a), kTagInt);
+            break;
+        }
+        case kLoadImmTag: {
+            e.storeImm64(B::kRegs, regOff(a), int32_t(d.x));
+            e.storeImm64(B::kRegs, tagOff(a), b);
+            break;
+        }
+        default:
+            return nullptr;
+        }
+    }
+    nativeOffset[size] = e.code.size();
+    e.ret();
+
+    for (auto [pos, target] : fixups) {
+        e.patch(pos, nativeOffset[target]);
+    }
+
+    return std::make_unique<NativeCode>(e.code);
+#else
+    return nullptr;
+#endif
+}
+
+const size_t kDefaultJitThreshold = 1000;
+
+// Wraps a CompiledProgram, interpreting it until it has been run 'threshold'
+// times and then switching to native code. Programs we can't compile natively just
+// keep being interpreted. Safe to share between threads, like CompiledProgram.
+struct TieredProgram {
+    TieredProgram(const CompiledProgram* p, size_t threshold = kDefaultJitThreshold)
+        : program(p),
+          jitThreshold(threshold) {
+    }
+
+    void run(ExecFrame* frame) {
+        assert(frame->program == program);
+#if EXEC_PROFILE
+        // Native code isn't instrumented, so keep interpreting frames being profiled.
+        if (frame->profile) {
+            frame->run();
+            return;
+        }
+#endif
+        if (auto fn = nativeFn.load(std::memory_order_acquire)) {
+            assert(frame->slots || program->numSlots == 0);
+            fn(frame->registers.data(), program->registerConstants(), frame->slots);
+            return;
+        }
+
+        // Only the thread that crosses the threshold compiles.
+        if (executions.fetch_add(1, std::memory_order_relaxed) + 1 == jitThreshold) {
+            native = compileNative(*program);
+            if (native) {
+                nativeFn.store(native->fn, std::memory_order_release);
+            }
+        }
+        frame->run();
+    }
+
+    bool isNative() const {
+        return nativeFn.load(std::memory_order_acquire) != nullptr;
+    }
+
+    const CompiledProgram* program;
+    size_t jitThreshold;
+
+    std::atomic<size_t> executions{0};
+    std::atomic<NativeFn> nativeFn{nullptr};
+    std::unique_ptr<NativeCode> native;
+};
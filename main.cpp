@@ -6,48 +6,35 @@
 #include "value.h"
 #include "expression.h"
 #include "instructions.h"
-#include "optimize.h"
+#include "compile.h"
 #include "exec.h"
 
-void runFull(OwnedExpression expr) {
+void runFull(OwnedExpression expr, std::vector<ValTagOwned> slots = {}) {
     assert(expr);
     std::cout << "RUNNING\n";
-    CompileCtx ctx;
-    expr = expr->optimize(std::move(expr));
+    StreamTrace trace(std::cout);
+    auto program = compile(std::move(expr), CompileOptions{}, trace);
 
-    auto res = expr->compile(&ctx);
-
-    std::cout << res.print() << std::endl;
-
-    std::cout << "SSA pass\n";
-    OptimizationCtx optCtx;
-    optimizePreSSA(&optCtx, &res);
-    std::cout << res.print() << std::endl;
-
-    std::cout << "Removing phi...\n";
-    removePhi(&res);
-    std::cout << res.print() << std::endl;
-
-    std::cout << "Post SSA optimizations...\n";
-    optimizePostSSA(&optCtx, &res);
-    std::cout << res.print() << std::endl;
-
-    std::cout << "Assembling..\n";
-    auto execInstructions = assemble(&res);
+    std::cout << "Running\n";
+    std::vector<RegisterValue> slotTable;
+    for (const auto& v : slots) {
+        slotTable.push_back(toRegister(v));
+    }
+    ExecFrame frame(&program);
+    frame.bindSlots(slotTable.data());
 
-    std::cout << "Assembled to\n";
-    std::cout << execInstructions.print() << std::endl;
+#if EXEC_PROFILE
+    ExecProfile profile(program.instructions.size(), true);
+    frame.setProfile(&profile);
+#endif
 
-    std::cout << "Running\n";
-    Function fnInfo{execInstructions.numRegisters};
-    Runtime rt(
-        fnInfo,
-        std::move(execInstructions.instructions),
-        std::move(execInstructions.constants)
-        );
+    frame.run();
+    std::cout << (int)frame.result().tag << " " << frame.result().val << std::endl;
 
-    rt.run();
-    std::cout << (int)rt.result().tag << " " << rt.result().val << std::endl;
+#if EXEC_PROFILE
+    std::cout << "Profile\n";
+    std::cout << profile.print(program.instructions, program.constants) << std::endl;
+#endif
     
     std::cout << std::endl << std::endl;
 }
@@ -73,8 +60,6 @@ int main() {
     }
 
     {
-        SlotAccessor s1{makeInt(101)};
-        
         auto iff = std::make_unique<ExpressionIf>(
             std::make_unique<ExpressionVariable>("foo"),
             std::make_unique<ExpressionBinOp>(
@@ -82,7 +67,7 @@ int main() {
                 std::make_unique<ExpressionVariable>("foo"),
                 std::make_unique<ExpressionBinOp>(
                     BinOpType::kAdd,
-                    makeSlot(&s1),
+                    makeSlot(0),
                     //makeConstInt(3),
                     makeConstInt(4)
                     )),
@@ -97,7 +82,7 @@ int main() {
             std::move(iff)
             );
 
-        runFull(std::move(letExpr));
+        runFull(std::move(letExpr), {makeInt(101)});
     }
 
 
@@ -112,15 +97,12 @@ int main() {
     execInstructions.append(InstrAdd{Register(0), Register(0), Register(0)});
     //execInstructions.append(InstrFillEmpty{Register(0), Register(0), Register(2)});
 
-    Function fnInfo{3};
-    Runtime rt(
-        fnInfo,
-        std::move(execInstructions.instructions),
-        std::move(execInstructions.constants)
-        );
+    execInstructions.numRegisters = 3;
+    CompiledProgram program(std::move(execInstructions));
+    ExecFrame frame(&program);
 
-    rt.run();
-    std::cout << (int)rt.result().tag << " " << rt.result().val << std::endl;
+    frame.run();
+    std::cout << (int)frame.result().tag << " " << frame.result().val << std::endl;
     
     return 0;
 }
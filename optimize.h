@@ -1,301 +1,1037 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+
 #include "instructions.h"
 #include "analysis.h"
+#include "cfg.h"
 
-struct TempConstraints {
-    bool canBeNothing = false;
-
-    TempConstraints accumulateOr(TempConstraints t) {
-        return TempConstraints{canBeNothing || t.canBeNothing};
-    }
+// What one pass did over all of its runs in a PassPipeline.
+struct PassStats {
+    const char* name = "";
+    size_t runs = 0;
+    // Runs which changed something.
+    size_t changes = 0;
+    // Instructions after the runs minus before them.
+    int64_t instrDelta = 0;
+    std::chrono::nanoseconds time{0};
 };
 
-struct OptimizationCtx {
-    std::map<TempId, TempConstraints> constraints;
-};
+// One run of a PassPipeline.
+struct PipelineStats {
+    const char* name = "";
+    size_t iterations = 0;
+    // False if the budget ran out first.
+    bool reachedFixpoint = false;
+    std::vector<PassStats> passes = {};
 
-size_t findDefinition(CompilationResult* r, TempId id) {
-    size_t off = 0;
-    for (auto& instr : r->instructions) {
-        auto dest = getDest(instr);
-        bool isHere = dest && *dest == id;
-        
-        if (isHere) {
-            return off;
+    std::string print() const {
+        std::stringstream out;
+        out << name << ": " << iterations << " iterations, " <<
+            (reachedFixpoint ? "fixpoint" : "budget exhausted") << "\n";
+        for (const auto& p : passes) {
+            out << "  " << p.name << " runs " << p.runs << " changed " << p.changes <<
+                " instrs " << (p.instrDelta > 0 ? "+" : "") << p.instrDelta << " us " <<
+                std::chrono::duration<double, std::micro>(p.time).count() << "\n";
         }
-        ++off;
+        return out.str();
     }
+};
 
-    return -1;
-}
+struct OptimizationCtx {
+    // Indexed by TempId.
+    std::vector<TempConstraints> constraints;
 
+    // Instructions removed by ValueNumberingPass because an earlier one already
+    // computed the same value.
+    size_t numRedundant = 0;
 
+    // How many times each pipeline may go through its passes before giving up on
+    // reaching a fixpoint. 1 runs every pass once, and 0 doesn't optimize at all.
+    size_t maxIterations = 4;
 
-void replaceTemp(CompilationResult* r, TempId oldTemp, TempId newTemp) {
-    for (auto& instr : r->instructions) {
-        std::visit(
-            Overloaded{
-                [&](LInstrLoadConst& lc) {
-                    if (lc.dst == oldTemp) {
-                        lc.dst = newTemp;
-                    }
-                },
-                [&](LInstrLoadSlot& lc) {
-                    if (lc.dst == oldTemp) {
-                        lc.dst = newTemp;
-                    }
-                },
-                [&](LInstrAdd& a) {
-                    if (a.dst == oldTemp) {
-                        a.dst = newTemp;
-                    }
-                    if (a.left == oldTemp) {
-                        a.left = newTemp;
-                    }
-                    if (a.right == oldTemp) {
-                        a.right = newTemp;
-                    }
-                },
-                [&](LInstrFillEmpty& a) {
-                    if (a.dst == oldTemp) {
-                        a.dst = newTemp;
-                    }
-                    if (a.left == oldTemp) {
-                        a.left = newTemp;
-                    }
-                    if (a.right == oldTemp) {
-                        a.right = newTemp;
-                    }
-                },
-                [&](LInstrJmp& j) {
-                },
-                [&](LInstrMove& m) {
-                    if (m.dst == oldTemp) {
-                        m.dst = newTemp;
-                    }
-                    if (m.src == oldTemp) {
-                        m.src = newTemp;
-                    }
-                },
-                [&](LInstrMovePhi& m) {
-                    assert(0);
-                },
-                [&](LInstrLabel& l) {
-                },
-                [&](LInstrTestTruthy& t) {
-                    if (t.reg == oldTemp) {
-                        t.reg = newTemp;
-                    }
-                },
-                [&](LInstrTestFalsey& t) {
-                    if (t.reg == oldTemp) {
-                        t.reg = newTemp;
-                    }
-                },
-                [&](LInstrTestNothing& t) {
-                    if (t.reg == oldTemp) {
-                        t.reg = newTemp;
-                    }
-                }
-            },
-            instr);
+    // Appended to by every PassPipeline run.
+    std::vector<PipelineStats> pipelineStats;
+};
+
+// Appends moves which have the effect of doing all of the (dst, src) copies at once.
+// Copies form chains and cycles when a temp is both copied from and to. Each chain
+// is done from its end, and each cycle is broken by saving one of its temps in a
+// new one, taken from 'nextTemp'. This is Boissinot et al.'s algorithm from
+// "Revisiting Out-of-SSA Translation for Correctness, Code Quality, and
+// Efficiency".
+void sequentializeCopies(const std::vector<std::pair<TempId, TempId>>& copies,
+                         TempId* nextTemp,
+                         std::vector<LInstr>* out) {
+    // There are only ever a handful of copies at once, so temps are looked up by
+    // searching rather than with a table.
+    const TempId kNone = ~TempId(0);
+    std::vector<TempId> temps;
+    auto index = [&](TempId t) {
+        auto it = std::find(temps.begin(), temps.end(), t);
+        if (it == temps.end()) {
+            temps.push_back(t);
+            return temps.size() - 1;
+        }
+        return size_t(it - temps.begin());
+    };
+    for (auto [dst, src] : copies) {
+        if (dst != src) {
+            index(dst);
+            index(src);
+        }
+    }
+    // loc: where the value originally in the temp can be found now.
+    // pred: the temp each destination is copied from.
+    std::vector<TempId> loc(temps.size(), kNone);
+    std::vector<TempId> pred(temps.size(), kNone);
+    std::vector<TempId> ready;
+    std::vector<TempId> todo;
+    for (auto [dst, src] : copies) {
+        if (dst != src) {
+            loc[index(src)] = src;
+            pred[index(dst)] = src;
+            todo.push_back(dst);
+        }
+    }
+    for (auto [dst, src] : copies) {
+        // Destinations nobody reads from can be written straight away.
+        if (dst != src && loc[index(dst)] == kNone) {
+            ready.push_back(dst);
+        }
+    }
+    while (!todo.empty()) {
+        while (!ready.empty()) {
+            auto b = ready.back();
+            ready.pop_back();
+            auto a = pred[index(b)];
+            auto c = loc[index(a)];
+            out->push_back(LInstrMove{b, c});
+            loc[index(a)] = b;
+            if (a == c && pred[index(a)] != kNone) {
+                ready.push_back(a);
+            }
+        }
+        auto b = todo.back();
+        todo.pop_back();
+        if (b != loc[index(pred[index(b)])]) {
+            auto t = (*nextTemp)++;
+            out->push_back(LInstrMove{t, b});
+            loc[index(b)] = t;
+            ready.push_back(b);
+        }
     }
 }
 
+// Translates out of SSA. Conceptually each phi becomes a set of parallel copies on
+// its incoming edges, done at the end of the predecessor block, before the test and
+// jmp ending it. A copy on an edge leaving a block with two successors also happens
+// when the other one is taken, but that's harmless: the phi's destination can only
+// be read after the phi, so it's dead on every path which doesn't go through it.
+//
+// Most copies aren't needed at all. A source whose value is dead by the time the
+// next region starts can share a name with the phi's destination, so its definition
+// writes the destination directly (and so do the definitions of anything that was
+// merged into the source earlier, for nested phis). Since we only jump forward, a
+// temp is live exactly between its definition and its last use in program order,
+// which makes checking whether two temps can share a name a comparison of spans.
+//
+// The pass is linear apart from sorting the copies which remain.
 void removePhi(CompilationResult* r) {
-    auto it = r->instructions.begin();
+    auto& instrs = r->instructions;
+    ControlFlowGraph cfg(*r);
+    auto n = numTemps(*r);
+    const size_t kNone = ~size_t(0);
 
-    while (it != r->instructions.end()) {
-        auto instr = *it;
-        if (std::holds_alternative<LInstrMovePhi>(instr)) {
-            // Remove the phi instruction.
-            r->instructions.erase(it);
+    // Copies for edges leaving 'b' go before its terminator, or at the end if it
+    // falls through.
+    auto copyPoint = [&](size_t b) {
+        const auto& block = cfg.blocks[b];
+        auto last = block.end - 1;
+        if (std::holds_alternative<LInstrJmp>(instrs[last])) {
+            return last > block.begin && isTest(instrs[last - 1]) ? last - 1 : last;
+        }
+        return block.end;
+    };
 
-            auto phiInstr = std::get<LInstrMovePhi>(instr);
+    // Every incoming edge of every phi, with the source it brings in.
+    struct PhiEdge {
+        size_t phi;
+        size_t source;
+        size_t copyPoint;
+    };
+    std::vector<PhiEdge> edges;
+    for (size_t i = 0; i < instrs.size(); ++i) {
+        auto* phi = std::get_if<LInstrMovePhi>(&instrs[i]);
+        if (!phi) {
+            continue;
+        }
+        forEachPhiEdge(cfg, cfg.blockOfInstr[i], *phi, [&](size_t p, size_t k) {
+            edges.push_back(PhiEdge{i, k, copyPoint(p)});
+        });
+    }
 
-            for (auto src : phiInstr.sources) {
-                auto srcOffset = findDefinition(r, src);
-                r->instructions.insert(r->instructions.begin() + srcOffset + 1,
-                                       LInstrMove{phiInstr.dst, src});
+    // The span of each temp, from its definition to its last use. A phi reads its
+    // sources at the copy points of their edges.
+    std::vector<size_t> lo(n, kNone);
+    std::vector<size_t> hi(n, 0);
+    for (size_t i = 0; i < instrs.size(); ++i) {
+        if (auto dest = getDest(instrs[i])) {
+            lo[*dest] = std::min(lo[*dest], i);
+        }
+        if (!std::holds_alternative<LInstrMovePhi>(instrs[i])) {
+            forEachSource(instrs[i], [&](TempId id) {
+                hi[id] = std::max(hi[id], i);
+            });
+        }
+    }
+    for (const auto& e : edges) {
+        auto src = std::get<LInstrMovePhi>(instrs[e.phi]).sources[e.source];
+        hi[src] = std::max(hi[src], e.copyPoint);
+    }
+    hi[r->tempId] = instrs.size();
 
-                // auto srcBOffset = findDefinition(r, phiInstr.srcB);
-                // r->instructions.insert(r->instructions.begin() + srcBOffset + 1,
-                //                        LInstrMove{phiInstr.dst, phiInstr.srcB});
+    // Temps sharing a name, as a union-find forest. lo and hi of a root cover the
+    // whole class.
+    std::vector<TempId> parent(n);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&](TempId id) {
+        while (parent[id] != id) {
+            id = parent[id] = parent[parent[id]];
+        }
+        return id;
+    };
+
+    // (copy point, dst, src)
+    std::vector<std::tuple<size_t, TempId, TempId>> copies;
+    for (size_t e = 0; e < edges.size();) {
+        const auto& phi = std::get<LInstrMovePhi>(instrs[edges[e].phi]);
+        auto d = find(phi.dst);
+        // Everything in the class so far ends by here, so whatever comes next must
+        // start after it.
+        size_t mergedHi = kNone;
+        auto isAfterMerged = [&](size_t pos) {
+            return mergedHi == kNone || pos > mergedHi;
+        };
+        while (e < edges.size() && &std::get<LInstrMovePhi>(instrs[edges[e].phi]) == &phi) {
+            // The edges bringing in one source.
+            auto k = edges[e].source;
+            auto end = e;
+            size_t regionEnd = 0;
+            while (end < edges.size() && edges[end].phi == edges[e].phi &&
+                   edges[end].source == k) {
+                regionEnd = std::max(regionEnd, edges[end].copyPoint);
+                ++end;
             }
 
-            // Iterator is invalidated now, just go to the beginning. Not efficient,
-            // but who cares?
-            it = r->instructions.begin();
-        } else {
-            ++it;
+            auto s = find(phi.sources[k]);
+            if (s == d) {
+                // Already there.
+            } else if (isAfterMerged(lo[s]) && hi[s] <= regionEnd) {
+                parent[s] = d;
+                lo[d] = std::min(lo[d], lo[s]);
+                mergedHi = mergedHi == kNone ? hi[s] : std::max(mergedHi, hi[s]);
+            } else {
+                for (auto i = e; i < end; ++i) {
+                    assert(isAfterMerged(edges[i].copyPoint));
+                    copies.push_back({edges[i].copyPoint, d, s});
+                    lo[d] = std::min(lo[d], edges[i].copyPoint);
+                    mergedHi = mergedHi == kNone ? edges[i].copyPoint :
+                        std::max(mergedHi, edges[i].copyPoint);
+                }
+            }
+            e = end;
         }
     }
-}
+    std::stable_sort(copies.begin(), copies.end(), [](const auto& a, const auto& b) {
+        return std::get<0>(a) < std::get<0>(b);
+    });
 
-void computeConstraints(OptimizationCtx* ctx, const CompilationResult* r) {
-    for (const auto& instr : r->instructions) {
-        std::visit(
-            Overloaded{
-                [&](LInstrLoadConst lc) {
-                    ctx->constraints[lc.dst] = TempConstraints{lc.constVal.tag == kTagNothing};
-                },
-                [&](LInstrLoadSlot lc) {
-                    ctx->constraints[lc.dst] = TempConstraints{true};
-                },
-                [&](LInstrAdd a) {
-                    // Could be smarter about this.
-                    ctx->constraints[a.dst] = TempConstraints{true};
-                },
-                [&](LInstrFillEmpty a) {
-                    ctx->constraints[a.dst] = TempConstraints{
-                        // If you do fillEmpty(a, Nothing), then you still get nothing.
-                        ctx->constraints[a.right].canBeNothing
-                    };
-                },
-                [&](LInstrJmp j) {
-                },
-                [&](LInstrMove m) {
-                    assert(ctx->constraints.count(m.src));
-                    ctx->constraints[m.dst] = ctx->constraints[m.src];
-                },
-                [&](LInstrMovePhi m) {
-                    TempConstraints constraint;
-                    for (auto& src : m.sources) {
-                        assert(ctx->constraints.count(src));
-                        constraint = constraint.accumulateOr(ctx->constraints[src]);
-                    }
-                    ctx->constraints[m.dst] = constraint;
-                },
-                [&](LInstrLabel l) {
-                },
-                [&](LInstrTestTruthy t) {
-                },
-                [&](LInstrTestFalsey t) {
-                },
-                [&](LInstrTestNothing t) {
-                }
-            },
-            instr);
+    // Rebuild the instructions with the phis dropped, the copies in place and every
+    // temp renamed to its class.
+    std::vector<LInstr> out;
+    out.reserve(instrs.size() + copies.size());
+    TempId nextTemp = n;
+    std::vector<std::pair<TempId, TempId>> parallel;
+    size_t c = 0;
+    for (size_t i = 0; i <= instrs.size(); ++i) {
+        parallel.clear();
+        for (; c < copies.size() && std::get<0>(copies[c]) == i; ++c) {
+            parallel.push_back({find(std::get<1>(copies[c])), find(std::get<2>(copies[c]))});
+        }
+        sequentializeCopies(parallel, &nextTemp, &out);
+        if (i == instrs.size()) {
+            break;
+        }
+        if (std::holds_alternative<LInstrMovePhi>(instrs[i])) {
+            continue;
+        }
+        out.push_back(std::move(instrs[i]));
+        forEachTempRef(out.back(), [&](TempId& id) {
+            id = find(id);
+        });
     }
+    instrs = std::move(out);
+    r->tempId = find(r->tempId);
 }
 
+// A pass returns whether it changed anything. Passes do all they can in one run, so
+// running one again straight away finds nothing more to do.
 struct OptimizationPass {
     virtual bool run(OptimizationCtx* ctx, CompilationResult* r) = 0;
+    virtual const char* name() const = 0;
     virtual ~OptimizationPass() = default;
 };
 
+// Runs its passes in order, over and over until a whole round of them changes
+// nothing or ctx->maxIterations rounds have run. One pass often leaves work for
+// another, like constant propagation folding away the last read of a temp, which
+// makes its store dead. Since a pass finds nothing more to do right after itself,
+// it's a fixpoint as soon as we come back round to the last pass which changed
+// anything, without running it again.
+//
+// How long each pass took and what it did is added to ctx->pipelineStats, to
+// weigh up the budget against compile time.
+struct PassPipeline {
+    PassPipeline(const char* n)
+        : name(n) {
+    }
+
+    void add(std::unique_ptr<OptimizationPass> pass) {
+        passes.push_back(std::move(pass));
+    }
+
+    void run(OptimizationCtx* ctx, CompilationResult* r) {
+        PipelineStats stats{name};
+        for (const auto& p : passes) {
+            stats.passes.push_back(PassStats{p->name()});
+        }
+        const size_t kNone = ~size_t(0);
+        size_t lastChange = kNone;
+        bool done = passes.empty();
+        while (!done && stats.iterations < ctx->maxIterations) {
+            for (size_t i = 0; i < passes.size(); ++i) {
+                if (i == lastChange) {
+                    done = true;
+                    break;
+                }
+                if (i == 0) {
+                    ++stats.iterations;
+                }
+                auto& passStats = stats.passes[i];
+                auto sizeBefore = r->instructions.size();
+                auto start = std::chrono::steady_clock::now();
+                bool changed = passes[i]->run(ctx, r);
+                passStats.time += std::chrono::steady_clock::now() - start;
+                passStats.instrDelta += int64_t(r->instructions.size()) - int64_t(sizeBefore);
+                ++passStats.runs;
+                if (changed) {
+                    ++passStats.changes;
+                    lastChange = i;
+                }
+            }
+            done = done || lastChange == kNone;
+        }
+        stats.reachedFixpoint = done;
+        ctx->pipelineStats.push_back(std::move(stats));
+    }
+
+    const char* name;
+    std::vector<std::unique_ptr<OptimizationPass>> passes;
+};
+
 struct DeadStorePass : public OptimizationPass {
+    const char* name() const {
+        return "dead-store";
+    }
+
     bool run(OptimizationCtx* ctx, CompilationResult* r) {
+        // Going backwards, removing an instruction can make the ones computing its
+        // inputs dead too, and we see those afterwards.
+        TempUses uses(r);
+        std::vector<bool> dead(r->instructions.size());
         bool didAnything = false;
-        auto it = r->instructions.begin();
-        while (it != r->instructions.end()) {
-            auto dest = getDest(*it);
+        for (size_t i = r->instructions.size(); i-- > 0;) {
+            auto dest = getDest(r->instructions[i]);
             // The temp representing the whole output is an exception.
-            if (dest && *dest != r->tempId && !isTempRead(r, *dest)) {
-                it = r->instructions.erase(it);
+            if (dest && *dest != r->tempId && uses.numReads(*dest) == 0) {
+                forEachSource(r->instructions[i], [&](TempId id) {
+                    --uses.count[id];
+                });
+                dead[i] = true;
                 didAnything = true;
-            } else {
-                ++it;
             }
         }
+
+        size_t out = 0;
+        for (size_t i = 0; i < r->instructions.size(); ++i) {
+            if (dead[i]) {
+                continue;
+            }
+            if (out != i) {
+                r->instructions[out] = std::move(r->instructions[i]);
+            }
+            ++out;
+        }
+        r->instructions.erase(r->instructions.begin() + out, r->instructions.end());
         return didAnything;
-    }    
+    }
 };
 
-struct RemoveRedundantNothingPass : public OptimizationPass {
+// Removes the tests which the constraints show can never pass, together with their
+// jmp, and fillEmpty where it's known which side wins. Constant propagation has
+// already handled the temps with a single value; this catches the ones with a
+// known tag or range, like the result of an add, which is never a bool.
+struct RemoveRedundantTestsPass : public OptimizationPass {
+    const char* name() const {
+        return "remove-redundant-tests";
+    }
+
     bool run(OptimizationCtx* ctx, CompilationResult* r) {
+        // Earlier passes may have made what's known more precise.
+        ctx->constraints = computeConstraints(*r);
+        const auto& constraints = ctx->constraints;
+        auto neverPasses = [&](const LInstr& instr) {
+            if (auto t = getAlternative<LInstrTestNothing>(instr)) {
+                return !constraints[t->reg].canBeNothing();
+            }
+            if (auto t = getAlternative<LInstrTestTruthy>(instr)) {
+                return constraints[t->reg].isNeverTruthy();
+            }
+            if (auto t = getAlternative<LInstrTestFalsey>(instr)) {
+                return constraints[t->reg].isAlwaysTruthy();
+            }
+            return false;
+        };
+
+        auto& instrs = r->instructions;
         bool didAnything = false;
-        auto it = r->instructions.begin();
-        while (it != r->instructions.end()) {
-            auto instr = *it;
-            if (auto testNothing = getAlternative<LInstrTestNothing>(instr)) {
-                if (!ctx->constraints[testNothing->reg].canBeNothing) {
-                    // Erase this instruction and the following jump.
-                    it = r->instructions.erase(it);
-                    it = r->instructions.erase(it);
-                    continue;
+        size_t out = 0;
+        for (size_t i = 0; i < instrs.size(); ++i) {
+            if (neverPasses(instrs[i])) {
+                // Skip the following jump too.
+                ++i;
+                didAnything = true;
+                continue;
+            }
+            if (auto fillEmpty = getAlternative<LInstrFillEmpty>(instrs[i])) {
+                const auto& left = constraints[fillEmpty->left];
+                if (!left.canBeNothing()) {
+                    instrs[i] = LInstrMove{fillEmpty->dst, fillEmpty->left};
+                    didAnything = true;
+                } else if (left.tags == TempConstraints::tagBit(kTagNothing)) {
+                    instrs[i] = LInstrMove{fillEmpty->dst, fillEmpty->right};
+                    didAnything = true;
+                }
+            }
+            if (out != i) {
+                instrs[out] = std::move(instrs[i]);
+            }
+            ++out;
+        }
+        instrs.erase(instrs.begin() + out, instrs.end());
+        return didAnything;
+    }
+};
+
+// What constant propagation knows about a temp. It only ever moves down, from
+// kUnknown (no definition of it can run, as far as we know yet) to kConst to
+// kVarying.
+struct LatticeValue {
+    enum class Kind {
+        kUnknown,
+        kConst,
+        kVarying
+    };
+    Kind kind = Kind::kUnknown;
+    ValTagOwned val{};
+
+    static LatticeValue constant(ValTagOwned v) {
+        return LatticeValue{Kind::kConst, v};
+    }
+    static LatticeValue varying() {
+        return LatticeValue{Kind::kVarying};
+    }
+
+    // The value, if it's known.
+    const ValTagOwned* getConst() const {
+        return kind == Kind::kConst ? &val : nullptr;
+    }
+
+    LatticeValue meet(const LatticeValue& o) const {
+        if (kind == Kind::kUnknown) {
+            return o;
+        }
+        if (o.kind == Kind::kUnknown || (getConst() && o.getConst() && val == o.val)) {
+            return *this;
+        }
+        return varying();
+    }
+};
+
+// Whether 'test' passes, if that's already known.
+std::optional<bool> decideTest(const LInstr& test, const std::vector<LatticeValue>& values) {
+    return std::visit(
+        Overloaded{
+            [&](const LInstrTestTruthy& t) -> std::optional<bool> {
+                if (auto* v = values[t.reg].getConst()) {
+                    return isConstTruthy(*v);
+                }
+                return {};
+            },
+            [&](const LInstrTestFalsey& t) -> std::optional<bool> {
+                if (auto* v = values[t.reg].getConst()) {
+                    return !isConstTruthy(*v);
+                }
+                return {};
+            },
+            [&](const LInstrTestNothing& t) -> std::optional<bool> {
+                if (auto* v = values[t.reg].getConst()) {
+                    return isConstNothing(*v);
+                }
+                return {};
+            },
+            [&](const auto&) -> std::optional<bool> {
+                return {};
+            }
+        },
+        test);
+}
+
+// Sparse conditional constant propagation (Wegman and Zadeck). Finds the temps
+// which always hold the same value and the tests which always go the same way,
+// only counting the code which can actually run, so a constant on one side of a
+// phi isn't spoiled by a branch which is never taken. Since we only jump forward,
+// all of a block's predecessors are done before it and one pass in program order
+// gets to the fixed point, with no worklist.
+//
+// Then temps which are constant are loaded directly, decided tests become a jmp or
+// go away, unreachable blocks are removed, and phis lose the sources whose edges
+// went with them.
+struct ConstantPropagationPass : public OptimizationPass {
+    const char* name() const {
+        return "constant-propagation";
+    }
+
+    bool run(OptimizationCtx* ctx, CompilationResult* r) {
+        auto& instrs = r->instructions;
+        if (instrs.empty()) {
+            return false;
+        }
+        ControlFlowGraph cfg(*r);
+        std::vector<LatticeValue> values(numTemps(*r));
+        std::vector<bool> reachable(cfg.blocks.size(), false);
+        // Bit j is set when the edge to succs(b)[j] can be taken.
+        std::vector<uint8_t> takenEdges(cfg.blocks.size(), 0);
+        auto isEdgeTaken = [&](size_t p, size_t b) {
+            auto succs = cfg.succs(p);
+            for (size_t j = 0; j < succs.size(); ++j) {
+                if (succs[j] == b) {
+                    return bool((takenEdges[p] >> j) & 1);
+                }
+            }
+            return false;
+        };
+
+        reachable[0] = true;
+        for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+            if (!reachable[b]) {
+                continue;
+            }
+            const auto& block = cfg.blocks[b];
+            for (size_t i = block.begin; i < block.end; ++i) {
+                if (auto dest = getDest(instrs[i])) {
+                    values[*dest] = evaluate(instrs[i], values, [&](const LInstrMovePhi& phi) {
+                        auto v = LatticeValue{};
+                        forEachPhiEdge(cfg, b, phi, [&](size_t p, size_t k) {
+                            if (isEdgeTaken(p, b)) {
+                                v = v.meet(values[phi.sources[k]]);
+                            }
+                        });
+                        return v;
+                    });
+                }
+            }
+
+            uint8_t taken = (1 << block.numSuccs) - 1;
+            auto last = block.end - 1;
+            if (last > block.begin && isTest(instrs[last - 1])) {
+                if (auto passes = decideTest(instrs[last - 1], values)) {
+                    // The jump target comes first, then the fall through if it's a
+                    // different block.
+                    taken = *passes || block.numSuccs == 1 ? 1 : 2;
+                }
+            }
+            takenEdges[b] = taken;
+            for (size_t j = 0; j < block.numSuccs; ++j) {
+                if ((taken >> j) & 1) {
+                    reachable[block.succs[j]] = true;
+                }
+            }
+        }
+
+        // The label starting the first reachable block at or after each block, for
+        // moving phi boundaries whose block is about to go. Reachable blocks don't
+        // all start with a label: the one after a test and its jmp is reached by
+        // falling through. But such a block is only reachable if the block before
+        // it is, so the first reachable block after an unreachable one always has a
+        // label. A boundary whose block goes therefore moves past removed blocks
+        // only, and each edge left into the phi stays in the same region. A boundary
+        // whose block stays is looked up at its own label.
+        const LabelId kNoLabel = ~LabelId(0);
+        std::vector<LabelId> nextLabel(cfg.blocks.size() + 1, kNoLabel);
+        for (size_t b = cfg.blocks.size(); b-- > 0;) {
+            nextLabel[b] = nextLabel[b + 1];
+            if (reachable[b]) {
+                if (auto l = getAlternative<LInstrLabel>(instrs[cfg.blocks[b].begin])) {
+                    nextLabel[b] = l->label;
                 }
             }
+        }
+
+        bool didAnything = false;
+        std::vector<LInstr> out;
+        out.reserve(instrs.size());
+        std::vector<bool> regionTaken;
+        for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+            const auto& block = cfg.blocks[b];
+            if (!reachable[b]) {
+                didAnything = true;
+                continue;
+            }
+            for (size_t i = block.begin; i < block.end; ++i) {
+                auto& instr = instrs[i];
+                if (isTest(instr)) {
+                    if (auto passes = decideTest(instr, values)) {
+                        // Keep the jmp following it only if it's always taken.
+                        if (*passes) {
+                            out.push_back(std::move(instrs[i + 1]));
+                        }
+                        ++i;
+                        didAnything = true;
+                        continue;
+                    }
+                }
 
-            if (auto fillEmpty = getAlternative<LInstrFillEmpty>(instr)) {
-                if (!ctx->constraints[fillEmpty->left].canBeNothing) {
-                    // Replace the fill empty with a simple move.
-                    *it = LInstrMove{fillEmpty->dst, fillEmpty->left};
+                auto dest = getDest(instr);
+                auto* c = dest ? values[*dest].getConst() : nullptr;
+                if (c && !std::holds_alternative<LInstrLoadConst>(instr)) {
+                    out.push_back(LInstrLoadConst{*dest, *c});
+                    didAnything = true;
                     continue;
                 }
+
+                if (auto* phi = std::get_if<LInstrMovePhi>(&instr)) {
+                    regionTaken.assign(phi->sources.size(), false);
+                    forEachPhiEdge(cfg, b, *phi, [&](size_t p, size_t k) {
+                        if (isEdgeTaken(p, b)) {
+                            regionTaken[k] = true;
+                        }
+                    });
+                    bool changed = std::find(regionTaken.begin(), regionTaken.end(), false) !=
+                        regionTaken.end();
+                    for (auto l : phi->boundaries) {
+                        changed = changed || !reachable[cfg.labelBlocks[l]];
+                    }
+                    if (changed) {
+                        out.push_back(rebuildPhi(*phi, regionTaken, [&](LabelId l) {
+                            auto next = nextLabel[cfg.labelBlocks[l]];
+                            assert(next != kNoLabel);
+                            return next;
+                        }, r->arena.get()));
+                        didAnything = true;
+                        continue;
+                    }
+                }
+                if (auto l = getAlternative<LInstrLabel>(instr)) {
+                    // A jump straight to the next label does nothing, which happens
+                    // when the code in between was unreachable.
+                    auto jmp = out.empty() ? std::nullopt : getAlternative<LInstrJmp>(out.back());
+                    if (jmp && jmp->label == l->label) {
+                        out.pop_back();
+                        if (!out.empty() && isTest(out.back())) {
+                            out.pop_back();
+                        }
+                    }
+                }
+                out.push_back(std::move(instr));
             }
-            ++it;
         }
+        instrs = std::move(out);
         return didAnything;
     }
+
+    // The value written by 'instr', given what's known about its sources so far.
+    template <typename EvaluatePhi>
+    static LatticeValue evaluate(const LInstr& instr, const std::vector<LatticeValue>& values,
+                                 EvaluatePhi evaluatePhi) {
+        return std::visit(
+            Overloaded{
+                [&](const LInstrLoadConst& lc) {
+                    return LatticeValue::constant(lc.constVal);
+                },
+                [&](const LInstrAdd& a) {
+                    const auto& l = values[a.left];
+                    const auto& r = values[a.right];
+                    if ((l.getConst() && isConstNothing(l.val)) ||
+                        (r.getConst() && isConstNothing(r.val))) {
+                        return LatticeValue::constant(makeNothing());
+                    }
+                    if (l.kind == LatticeValue::Kind::kUnknown ||
+                        r.kind == LatticeValue::Kind::kUnknown) {
+                        return LatticeValue{};
+                    }
+                    if (l.getConst() && r.getConst()) {
+                        return LatticeValue::constant(addConsts(l.val, r.val));
+                    }
+                    return LatticeValue::varying();
+                },
+                [&](const LInstrFillEmpty& a) {
+                    const auto& l = values[a.left];
+                    if (l.getConst() && isConstNothing(l.val)) {
+                        return values[a.right];
+                    }
+                    // Otherwise it's the left, whatever that is.
+                    return l;
+                },
+                [&](const LInstrMove& m) {
+                    return values[m.src];
+                },
+                [&](const LInstrMovePhi& m) {
+                    return evaluatePhi(m);
+                },
+                [&](const auto&) {
+                    return LatticeValue::varying();
+                }
+            },
+            instr);
+    }
+
+    // A copy of 'phi' with only the sources whose regions still have edges into
+    // it, moving boundaries with 'moveBoundary'. Each kept region now also covers
+    // the dropped ones before it. A phi left with one source is just a move.
+    template <typename MoveBoundary>
+    static LInstr rebuildPhi(const LInstrMovePhi& phi, const std::vector<bool>& regionTaken,
+                             MoveBoundary moveBoundary, CompileArena* arena) {
+        LInstrMovePhi res{phi.dst, std::pmr::vector<TempId>(arena),
+                          std::pmr::vector<LabelId>(arena)};
+        for (size_t k = 0; k < phi.sources.size(); ++k) {
+            if (!regionTaken[k]) {
+                continue;
+            }
+            if (!res.sources.empty()) {
+                res.boundaries.push_back(moveBoundary(phi.boundaries[k - 1]));
+            }
+            res.sources.push_back(phi.sources[k]);
+        }
+        assert(!res.sources.empty());
+        if (res.sources.size() == 1) {
+            return LInstrMove{phi.dst, res.sources[0]};
+        }
+        return res;
+    }
 };
 
-void optimizePreSSA(OptimizationCtx* ctx, CompilationResult* r) {
-    computeConstraints(ctx, r);
-    std::cout << "Constraints generated:\n";
-    for (auto& [tempId, con] : ctx->constraints) {
-        std::cout << tmpStr(tempId) << " " <<
-            (con.canBeNothing ? "maybe-nothing" : "not-nothing") << std::endl;
+// Global value numbering over the SSA form, scoped by the dominator tree (the
+// dominator-based value numbering of Briggs, Cooper and Simpson). Walking the tree
+// depth first, an instruction which computes the same thing from the same values as
+// one in a dominating block is removed, and its temp replaced by the earlier one
+// everywhere. A block's dominators are the only blocks sure to have run before it,
+// so nothing computed on just one side of a branch is reused after it.
+//
+// Moves, and phis whose sources are all the same, are removed the same way.
+//
+// A load read by a phi is left alone even if it's redundant. It can usually share
+// a name with the phi's destination, whereas reusing the earlier temp would need a
+// copy on every incoming edge, and a load is no more expensive than a copy.
+struct ValueNumberingPass : public OptimizationPass {
+    // What an instruction computes, with its sources replaced by their leaders.
+    struct Key {
+        enum class Op : uint8_t {
+            kLoadConst,
+            kLoadSlot,
+            kAdd,
+            kFillEmpty
+        };
+        Op op;
+        uint64_t a = 0;
+        uint64_t b = 0;
+
+        bool operator==(const Key&) const = default;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            auto h = k.a * 0x9e3779b97f4a7c15ull;
+            h ^= (k.b + uint64_t(k.op)) * 0xc2b2ae3d27d4eb4full;
+            return h ^ (h >> 29);
+        }
+    };
+
+    const char* name() const {
+        return "value-numbering";
     }
-    
-    std::vector<std::unique_ptr<OptimizationPass>> passes;
-    passes.push_back(std::make_unique<RemoveRedundantNothingPass>());
-    passes.push_back(std::make_unique<DeadStorePass>());
-    for (auto& p : passes) {
-        p->run(ctx, r);
+
+    bool run(OptimizationCtx* ctx, CompilationResult* r) {
+        auto& instrs = r->instructions;
+        if (instrs.empty()) {
+            return false;
+        }
+        ControlFlowGraph cfg(*r);
+
+        // The temp holding the same value which was computed first.
+        std::vector<TempId> leader(numTemps(*r));
+        std::iota(leader.begin(), leader.end(), 0);
+        std::vector<bool> removed(instrs.size());
+        size_t numRemoved = 0;
+        std::vector<bool> readByPhi(leader.size());
+        for (const auto& instr : instrs) {
+            if (auto* phi = std::get_if<LInstrMovePhi>(&instr)) {
+                for (auto src : phi->sources) {
+                    readByPhi[src] = true;
+                }
+            }
+        }
+
+        // Values computed in the blocks from the root of the dominator tree down to
+        // the current one. Each key is only added if it isn't there already, so
+        // leaving a block just erases the ones it added. The nodes come from a bump
+        // allocator, as there's one for nearly every instruction.
+        std::pmr::monotonic_buffer_resource pool;
+        std::pmr::unordered_map<Key, TempId, KeyHash> available(&pool);
+        std::vector<Key> added;
+        auto valueNumber = [&](size_t i) {
+            auto dest = getDest(instrs[i]);
+            if (!dest) {
+                return;
+            }
+            std::optional<TempId> same;
+            std::optional<Key> key;
+            bool canRemove = true;
+            std::visit(
+                Overloaded{
+                    [&](const LInstrLoadConst& lc) {
+                        canRemove = !readByPhi[lc.dst];
+                        key = Key{Key::Op::kLoadConst, lc.constVal.val,
+                                  uint64_t(lc.constVal.tag) | uint64_t(lc.constVal.owned) << 8};
+                    },
+                    [&](const LInstrLoadSlot& ls) {
+                        canRemove = !readByPhi[ls.dst];
+                        key = Key{Key::Op::kLoadSlot, ls.slot};
+                    },
+                    [&](const LInstrAdd& a) {
+                        // Adding is commutative.
+                        auto l = leader[a.left];
+                        auto r = leader[a.right];
+                        key = Key{Key::Op::kAdd, std::min(l, r), std::max(l, r)};
+                    },
+                    [&](const LInstrFillEmpty& a) {
+                        key = Key{Key::Op::kFillEmpty, leader[a.left], leader[a.right]};
+                    },
+                    [&](const LInstrMove& m) {
+                        same = leader[m.src];
+                    },
+                    [&](const LInstrMovePhi& m) {
+                        auto first = leader[m.sources[0]];
+                        bool allSame = std::all_of(m.sources.begin(), m.sources.end(),
+                                                   [&](TempId src) {
+                                                       return leader[src] == first;
+                                                   });
+                        if (allSame) {
+                            same = first;
+                        }
+                    },
+                    [&](const auto&) {
+                    }
+                },
+                instrs[i]);
+            if (key) {
+                auto [it, inserted] = available.try_emplace(*key, *dest);
+                if (inserted) {
+                    added.push_back(*key);
+                    return;
+                }
+                if (!canRemove) {
+                    return;
+                }
+                same = it->second;
+            }
+            if (same) {
+                leader[*dest] = *same;
+                removed[i] = true;
+                ++numRemoved;
+            }
+        };
+
+        // (block, index of the next child to visit, size of 'added' on entry)
+        std::vector<std::tuple<size_t, size_t, size_t>> stack;
+        auto enter = [&](size_t b) {
+            stack.push_back({b, 0, added.size()});
+            for (auto i = cfg.blocks[b].begin; i < cfg.blocks[b].end; ++i) {
+                valueNumber(i);
+            }
+        };
+        enter(0);
+        while (!stack.empty()) {
+            auto& [b, child, numAdded] = stack.back();
+            if (child < cfg.domChildren(b).size()) {
+                enter(cfg.domChildren(b)[child++]);
+                continue;
+            }
+            for (auto k = numAdded; k < added.size(); ++k) {
+                available.erase(added[k]);
+            }
+            added.resize(numAdded);
+            stack.pop_back();
+        }
+
+        if (numRemoved == 0) {
+            return false;
+        }
+        size_t out = 0;
+        for (size_t i = 0; i < instrs.size(); ++i) {
+            if (removed[i]) {
+                continue;
+            }
+            forEachTempRef(instrs[i], [&](TempId& id) {
+                id = leader[id];
+            });
+            if (out != i) {
+                instrs[out] = std::move(instrs[i]);
+            }
+            ++out;
+        }
+        instrs.erase(instrs.begin() + out, instrs.end());
+        r->tempId = leader[r->tempId];
+        ctx->numRedundant += numRemoved;
+        return true;
     }
+};
+
+void optimizePreSSA(OptimizationCtx* ctx, CompilationResult* r) {
+    PassPipeline pipeline("pre-ssa");
+    pipeline.add(std::make_unique<ConstantPropagationPass>());
+    pipeline.add(std::make_unique<ValueNumberingPass>());
+    pipeline.add(std::make_unique<RemoveRedundantTestsPass>());
+    pipeline.add(std::make_unique<DeadStorePass>());
+    pipeline.run(ctx, r);
     // find move TA, TB instruction. If the definition of TB is available in this block then get rid
     // of the move and use TA everywhere TB is used.
 }
 
+// Removes 'mov A, B' by renaming B to A everywhere, where that can't change what
+// anything reads: B is only assigned once, earlier in the same block, the move is
+// the last read of B, and A isn't touched between B's assignment and the move.
+// This runs after phi removal, so temps can be assigned more than once and all of
+// that has to be checked. All of the renames are collected in one pass and applied
+// in another.
 struct BasicCopyPropPass : public OptimizationPass {
+    const char* name() const {
+        return "copy-propagation";
+    }
+
     bool run(OptimizationCtx* ctx, CompilationResult* r) {
+        ControlFlowGraph cfg(*r);
+        TempUses uses(r);
+        auto n = numTemps(*r);
+
+        // What each temp has been renamed to so far, following the chain until a
+        // temp maps to itself. The tables below are indexed by the root.
+        std::vector<TempId> renamed(n);
+        std::iota(renamed.begin(), renamed.end(), 0);
+        auto find = [&](TempId id) {
+            while (renamed[id] != id) {
+                id = renamed[id] = renamed[renamed[id]];
+            }
+            return id;
+        };
+        std::vector<size_t> numDefs(n, 0);
+        std::vector<size_t> firstDef(n, kNone);
+        std::vector<size_t> lastRead(n, kNone);
+        // Last instruction which read or wrote the temp, so far.
+        std::vector<size_t> lastAccess(n, kNone);
+        for (size_t i = 0; i < r->instructions.size(); ++i) {
+            if (auto dest = getDest(r->instructions[i])) {
+                ++numDefs[*dest];
+            }
+        }
+        for (TempId id = 0; id < n; ++id) {
+            lastRead[id] = id < uses.lastRead.size() ? uses.lastRead[id] : TempUses::kNotRead;
+        }
+        // The result is read at the end.
+        lastRead[r->tempId] = r->instructions.size();
+
+        std::vector<bool> removed(r->instructions.size());
         bool didAnything = false;
-        
-        auto it = r->instructions.begin();
-        while (it != r->instructions.end()) {
-            auto instr = *it;
-        
-            if (std::holds_alternative<LInstrMove>(instr)) {
-                auto moveInstr = std::get<LInstrMove>(instr);
-                auto srcDefinition = findDefinition(r, moveInstr.src);
-
-                // Is there a jump between the definition and here?
-                auto it2 = r->instructions.begin() + srcDefinition;
-
-                bool foundJump = false;
-                while (it2 != it) {
-                    if (std::holds_alternative<LInstrJmp>(*it2)) {
-                        foundJump = true;
-                        break;
+        for (size_t i = 0; i < r->instructions.size(); ++i) {
+            const auto& instr = r->instructions[i];
+            if (auto move = getAlternative<LInstrMove>(instr)) {
+                auto src = find(move->src);
+                auto dst = find(move->dst);
+                auto def = firstDef[src];
+                bool canRename = src == dst ||
+                    (numDefs[src] == 1 && def != kNone &&
+                     cfg.blockOfInstr[def] == cfg.blockOfInstr[i] &&
+                     lastRead[src] == i &&
+                     (lastAccess[dst] == kNone || lastAccess[dst] < def));
+                if (canRename) {
+                    if (src != dst) {
+                        renamed[src] = dst;
+                        // The move's own assignment of dst goes away.
+                        numDefs[dst] += numDefs[src] - 1;
+                        firstDef[dst] = std::min(firstDef[dst], def);
+                        lastAccess[dst] = i;
                     }
-                    ++it2;
-                }
-
-                if (!foundJump) {
-                    replaceTemp(r, moveInstr.src, moveInstr.dst);
-                    it = r->instructions.erase(it);
+                    removed[i] = true;
                     didAnything = true;
-                } else {
-                    ++it;
+                    continue;
                 }
-            } else {
-                ++it;
+            }
+            if (auto dest = getDest(instr)) {
+                auto& def = firstDef[find(*dest)];
+                def = std::min(def, i);
+            }
+            forEachSource(instr, [&](TempId id) {
+                lastAccess[find(id)] = i;
+            });
+            if (auto dest = getDest(instr)) {
+                lastAccess[find(*dest)] = i;
             }
         }
+        if (!didAnything) {
+            return false;
+        }
 
-        return didAnything;
+        size_t out = 0;
+        for (size_t i = 0; i < r->instructions.size(); ++i) {
+            if (removed[i]) {
+                continue;
+            }
+            forEachTempRef(r->instructions[i], [&](TempId& id) {
+                id = find(id);
+            });
+            if (out != i) {
+                r->instructions[out] = std::move(r->instructions[i]);
+            }
+            ++out;
+        }
+        r->instructions.erase(r->instructions.begin() + out, r->instructions.end());
+        r->tempId = find(r->tempId);
+        return true;
     }
+
+    static constexpr size_t kNone = ~size_t(0);
 };
 
 void optimizePostSSA(OptimizationCtx* ctx, CompilationResult* r) {
-    std::vector<std::unique_ptr<OptimizationPass>> passes;
-    passes.push_back(std::make_unique<BasicCopyPropPass>());
-
-    for (auto& p : passes) {
-        p->run(ctx, r);
-    }
+    PassPipeline pipeline("post-ssa");
+    pipeline.add(std::make_unique<BasicCopyPropPass>());
+    pipeline.run(ctx, r);
     // find move TA, TB instruction. If the definition of TB is available in this block then get rid
     // of the move and use TA everywhere TB is used.
 }
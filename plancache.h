@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "value.h"
+#include "expression.h"
+#include "compile.h"
+#include "exec.h"
+
+// A compiled program for one expression shape. Its constants are params, which it
+// reads from the slots after the ones the expression reads itself.
+struct CachedPlan {
+    CachedPlan(ExecInstructions is, SlotId base, size_t n)
+        : program(std::move(is)),
+          paramSlotBase(base),
+          numParams(n) {
+    }
+
+    CompiledProgram program;
+    SlotId paramSlotBase;
+    size_t numParams;
+};
+
+// A cached plan together with the values of the params for one expression.
+struct BoundPlan {
+    // Fills 'table' with 'slots' followed by the params, ready to pass to
+    // ExecFrame::bindSlots(). In packed builds the table can point into 'slots' and
+    // into this, so both have to outlive the runs.
+    void makeSlotTable(const std::vector<ValTagOwned>& slots,
+                       std::vector<RegisterValue>* table) const {
+        table->clear();
+        for (size_t i = 0; i < std::min<size_t>(slots.size(), plan->paramSlotBase); ++i) {
+            table->push_back(toRegister(slots[i]));
+        }
+        table->resize(plan->paramSlotBase, toRegister(makeNothing()));
+        for (const auto& p : params) {
+            table->push_back(toRegister(p));
+        }
+    }
+
+    const CompiledProgram& program() const {
+        return plan->program;
+    }
+
+    std::shared_ptr<const CachedPlan> plan;
+    std::vector<ValTagOwned> params;
+};
+
+struct PlanCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+// Compiled programs keyed by the shape of the optimized expression, so expressions
+// which only differ in their constants share one. Lookups can come from any number
+// of threads. Hits only take the lock shared; misses compile without holding it,
+// and then take it exclusively to insert.
+//
+// Once the programs use more than 'memoryBudget' bytes, the least recently used are
+// evicted. Plans handed out are reference counted, so evicting one which is still
+// running is fine.
+struct PlanCache {
+    PlanCache(size_t budget)
+        : memoryBudget(budget) {
+    }
+
+    BoundPlan lookup(OwnedExpression expr) {
+        expr = expr->optimize(std::move(expr));
+        ShapeCtx shapeCtx;
+        expr = expr->parameterize(std::move(expr), &shapeCtx);
+
+        BoundPlan res;
+        res.params = std::move(shapeCtx.params);
+        {
+            std::shared_lock lock(mutex);
+            if (auto it = entries.find(shapeCtx.shape); it != entries.end()) {
+                touch(it->second);
+                ++hits;
+                res.plan = it->second.plan;
+                return res;
+            }
+        }
+
+        ++misses;
+        auto plan = compilePlan(std::move(expr), shapeCtx.numSlots, res.params.size());
+        auto bytes = plan->program.memoryUsage() + shapeCtx.shape.capacity() + sizeof(Entry);
+
+        std::unique_lock lock(mutex);
+        auto [it, inserted] = entries.try_emplace(std::move(shapeCtx.shape), std::move(plan), bytes);
+        // If another thread compiled the same shape meanwhile, use theirs.
+        touch(it->second);
+        res.plan = it->second.plan;
+        if (inserted) {
+            totalBytes += bytes;
+            evictOverBudget(&it->second);
+        }
+        return res;
+    }
+
+    PlanCacheStats stats() const {
+        std::shared_lock lock(mutex);
+        return PlanCacheStats{hits, misses, evictions, entries.size(), totalBytes};
+    }
+
+private:
+    struct Entry {
+        Entry(std::shared_ptr<const CachedPlan> p, size_t b)
+            : plan(std::move(p)),
+              bytes(b) {
+        }
+
+        std::shared_ptr<const CachedPlan> plan;
+        size_t bytes;
+        // Value of 'clock' when last looked up. Updated under the shared lock, so
+        // concurrent hits race on it, which only makes the LRU order approximate.
+        std::atomic<uint64_t> lastUsed{0};
+    };
+
+    void touch(Entry& e) {
+        e.lastUsed.store(clock.fetch_add(1, std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+    }
+
+    static std::shared_ptr<const CachedPlan> compilePlan(OwnedExpression expr, SlotId paramSlotBase,
+                                                         size_t numParams) {
+        CompileOptions opts;
+        // lookup() has simplified it already.
+        opts.simplify = false;
+        opts.paramSlotBase = paramSlotBase;
+        return std::make_shared<const CachedPlan>(compileInstructions(std::move(expr), opts),
+                                                  paramSlotBase, numParams);
+    }
+
+    // Called with the lock held exclusively. Never evicts 'keep', which was just
+    // inserted, even if it's over the budget on its own.
+    void evictOverBudget(const Entry* keep) {
+        if (totalBytes <= memoryBudget) {
+            return;
+        }
+        std::vector<std::pair<uint64_t, const std::string*>> order;
+        order.reserve(entries.size());
+        for (const auto& [shape, e] : entries) {
+            if (&e != keep) {
+                order.push_back({e.lastUsed.load(std::memory_order_relaxed), &shape});
+            }
+        }
+        std::sort(order.begin(), order.end());
+        for (auto [lastUsed, shape] : order) {
+            if (totalBytes <= memoryBudget) {
+                break;
+            }
+            auto it = entries.find(*shape);
+            totalBytes -= it->second.bytes;
+            entries.erase(it);
+            ++evictions;
+        }
+    }
+
+    const size_t memoryBudget;
+
+    mutable std::shared_mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    size_t totalBytes = 0;
+    std::atomic<uint64_t> clock{0};
+
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> misses{0};
+    size_t evictions = 0;
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <span>
+#include <sstream>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "value.h"
+#include "assembler.h"
+
+// Interpreter instrumentation. Counting every instruction costs more than running
+// most of them, so it's compiled out unless EXEC_PROFILE=1. In a profiling build,
+// attach an ExecProfile to an ExecFrame to collect counts for its runs.
+#ifndef EXEC_PROFILE
+#define EXEC_PROFILE 0
+#endif
+
+// Cycles on x86, nanoseconds elsewhere.
+inline uint64_t readCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// True for instructions which may or may not jump. The unfused tests count as
+// taken when they run the jmp following them.
+inline bool isConditionalBranch(InstrCode op) {
+    switch (op) {
+    case kTestEq:
+    case kTestTruthy:
+    case kTestFalsey:
+    case kTestNothing:
+    case kJmpIfTruthy:
+    case kJmpIfFalsey:
+    case kJmpIfNothing:
+    case kJmpIfTrue:
+    case kJmpIfFalse:
+        return true;
+    default:
+        return false;
+    }
+}
+
+inline const char* opcodeName(InstrCode op) {
+    // Same order as InstrCode.
+    static const char* const kNames[] = {
+        "loadc", "loadslot", "mov", "add", "eq", "fillempty", "testeq", "testt",
+        "testf", "jmp", "testn", "jmpt", "jmpf", "jmpn", "addc", "loadi", "loadi(tag)",
+        "addi", "addint", "jmptrue", "jmpfalse", "wide",
+    };
+    static_assert(sizeof(kNames) / sizeof(kNames[0]) == kWide + 1);
+    return kNames[op];
+}
+
+// Counts for one program, indexed by the bytecode offset of each instruction. Not
+// thread safe, so every thread running the program needs its own.
+struct ExecProfile {
+    ExecProfile(size_t codeSize, bool sampleCycles = false)
+        : executed(codeSize),
+          taken(codeSize),
+          cycles(sampleCycles ? codeSize : 0),
+          sampleCycles(sampleCycles) {
+    }
+
+    // Called by the interpreter at the start of every instruction. With cycle
+    // sampling on, the time until the next call is charged to this instruction,
+    // dispatch included.
+    void enter(size_t off) {
+        ++executed[off];
+        if (sampleCycles) {
+            auto now = readCycleCounter();
+            if (current != kNone) {
+                cycles[current] += now - last;
+            }
+            current = off;
+            last = now;
+        }
+    }
+    void branch(size_t off, bool wasTaken) {
+        taken[off] += wasTaken;
+    }
+    void exit() {
+        if (current != kNone) {
+            cycles[current] += readCycleCounter() - last;
+            current = kNone;
+        }
+        ++runs;
+    }
+
+    // Executions of each opcode, indexed by InstrCode. Wide instructions are counted
+    // under the instruction they wrap.
+    std::vector<uint64_t> opcodeCounts(std::span<const char> instructions) const {
+        std::vector<uint64_t> counts(kWide + 1);
+        for (size_t off = 0; off < instructions.size();) {
+            auto d = decodeInstr(instructions.data(), off);
+            counts[d.op] += executed[off];
+            off += d.size;
+        }
+        return counts;
+    }
+
+    // The per opcode totals, followed by the program listing with the counts for
+    // each instruction next to it.
+    std::string print(std::span<const char> instructions,
+                      std::span<const ValTagOwned> constants) const {
+        std::stringstream out;
+        out << "runs " << runs << "\n";
+
+        auto counts = opcodeCounts(instructions);
+        uint64_t total = 0;
+        std::vector<InstrCode> byCount;
+        for (size_t op = 0; op < counts.size(); ++op) {
+            total += counts[op];
+            if (counts[op]) {
+                byCount.push_back(InstrCode(op));
+            }
+        }
+        std::sort(byCount.begin(), byCount.end(), [&](InstrCode l, InstrCode r) {
+            return counts[l] > counts[r];
+        });
+        for (auto op : byCount) {
+            out << "  " << opcodeName(op) << ": " << counts[op] << " (" <<
+                100.0 * double(counts[op]) / double(total) << "%)\n";
+        }
+
+        out << printInstructions(instructions, constants, [&](size_t off) {
+            std::stringstream a;
+            a << "# " << executed[off];
+            auto d = decodeInstr(instructions.data(), off);
+            if (isConditionalBranch(d.op)) {
+                a << " taken " << taken[off] << " not taken " << executed[off] - taken[off];
+            }
+            if (sampleCycles && executed[off]) {
+                a << " cycles/exec " << double(cycles[off]) / double(executed[off]);
+            }
+            return a.str();
+        });
+        return out.str();
+    }
+
+    static constexpr size_t kNone = ~size_t(0);
+
+    std::vector<uint64_t> executed;
+    std::vector<uint64_t> taken;
+    std::vector<uint64_t> cycles;
+    bool sampleCycles;
+    uint64_t runs = 0;
+
+    // Instruction being timed, and when it started.
+    size_t current = kNone;
+    uint64_t last = 0;
+};
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <span>
+
+#include "instructions.h"
+#include "analysis.h"
+#include "cfg.h"
+
+const Register kNoRegister = std::numeric_limits<Register>::max();
+
+// Instruction i reads its operands at position 2i and writes its destination at
+// 2i + 1, so a temp last read by an instruction can share a register with the temp
+// it defines.
+struct LiveRange {
+    size_t start;
+    size_t end;
+};
+
+// The positions at which a temp holds a value which is still needed. After phi
+// removal a temp can be assigned on several paths, so this is a list of disjoint
+// ranges, in order, with holes where the temp is dead.
+struct LiveInterval {
+    std::span<const LiveRange> ranges;
+
+    bool empty() const {
+        return ranges.empty();
+    }
+    size_t start() const {
+        return ranges.front().start;
+    }
+    size_t end() const {
+        return ranges.back().end;
+    }
+};
+
+// Whether the ranges of 'a' from index 'from' onwards overlap any of 'b'.
+inline bool intersects(const LiveInterval& a, size_t from, const LiveInterval& b) {
+    size_t j = 0;
+    for (size_t i = from; i < a.ranges.size() && j < b.ranges.size();) {
+        const auto& x = a.ranges[i];
+        const auto& y = b.ranges[j];
+        if (x.end <= y.start) {
+            ++i;
+        } else if (y.end <= x.start) {
+            ++j;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The intervals of every temp, indexed by TempId, with all of the ranges in one
+// flat list. Those of temp t are [start[t], start[t + 1]).
+struct LiveIntervals {
+    std::vector<LiveRange> ranges;
+    std::vector<size_t> start;
+
+    size_t size() const {
+        return start.size() - 1;
+    }
+    LiveInterval operator[](TempId id) const {
+        return LiveInterval{{ranges.data() + start[id], start[id + 1] - start[id]}};
+    }
+};
+
+// Live intervals of every temp, indexed by TempId. Liveness is computed per block,
+// walking the blocks backwards; since every jump goes forward, a block's successors
+// are always done before it and one pass is enough. The result is live at the end
+// of the program.
+LiveIntervals computeLiveIntervals(const CompilationResult& r, const ControlFlowGraph& cfg) {
+    const auto& instrs = r.instructions;
+    auto n = numTemps(r);
+
+    // Ranges are found last to first. Each one is pushed on the front of a list for
+    // its temp, so the lists come out in order, and a range ending where the
+    // previous one started is merged into it.
+    const size_t kNone = ~size_t(0);
+    std::vector<LiveRange> pool;
+    std::vector<size_t> next;
+    std::vector<size_t> head(n, kNone);
+    std::vector<size_t> count(n, 0);
+    auto addRange = [&](TempId id, size_t start, size_t end) {
+        if (head[id] != kNone && pool[head[id]].start == end) {
+            pool[head[id]].start = start;
+            return;
+        }
+        pool.push_back(LiveRange{start, end});
+        next.push_back(head[id]);
+        head[id] = pool.size() - 1;
+        ++count[id];
+    };
+
+    // One bitset of live temps per block, all in one allocation.
+    auto words = (n + 63) / 64;
+    std::vector<uint64_t> liveIn(cfg.blocks.size() * words, 0);
+    std::vector<uint64_t> live(words);
+    auto test = [&](TempId id) {
+        return (live[id / 64] >> (id % 64)) & 1;
+    };
+    auto set = [&](TempId id) {
+        live[id / 64] |= uint64_t(1) << (id % 64);
+    };
+    auto clear = [&](TempId id) {
+        live[id / 64] &= ~(uint64_t(1) << (id % 64));
+    };
+    auto forEachLive = [&](auto f) {
+        for (size_t w = 0; w < words; ++w) {
+            for (auto bits = live[w]; bits; bits &= bits - 1) {
+                f(TempId(w * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    };
+
+    // Where the range currently being built for each live temp ends.
+    std::vector<size_t> openEnd(n);
+    for (size_t b = cfg.blocks.size(); b-- > 0;) {
+        const auto& block = cfg.blocks[b];
+        std::fill(live.begin(), live.end(), 0);
+        for (auto s : cfg.succs(b)) {
+            for (size_t w = 0; w < words; ++w) {
+                live[w] |= liveIn[s * words + w];
+            }
+        }
+        if (b + 1 == cfg.blocks.size()) {
+            set(r.tempId);
+        }
+        forEachLive([&](TempId id) {
+            openEnd[id] = 2 * block.end;
+        });
+
+        for (size_t i = block.end; i-- > block.begin;) {
+            if (auto dest = getDest(instrs[i])) {
+                if (test(*dest)) {
+                    addRange(*dest, 2 * i + 1, openEnd[*dest]);
+                    clear(*dest);
+                } else {
+                    // Never read, but it still needs somewhere to go.
+                    addRange(*dest, 2 * i + 1, 2 * i + 2);
+                }
+            }
+            forEachSource(instrs[i], [&](TempId id) {
+                if (!test(id)) {
+                    set(id);
+                    openEnd[id] = 2 * i + 1;
+                }
+            });
+        }
+
+        forEachLive([&](TempId id) {
+            addRange(id, 2 * block.begin, openEnd[id]);
+        });
+        std::copy(live.begin(), live.end(), liveIn.begin() + b * words);
+    }
+
+    LiveIntervals intervals;
+    intervals.start.assign(n + 1, 0);
+    for (size_t id = 0; id < n; ++id) {
+        intervals.start[id + 1] = intervals.start[id] + count[id];
+    }
+    intervals.ranges.resize(pool.size());
+    for (size_t id = 0; id < n; ++id) {
+        auto out = intervals.start[id];
+        for (auto i = head[id]; i != kNone; i = next[i]) {
+            intervals.ranges[out++] = pool[i];
+        }
+    }
+    return intervals;
+}
+
+struct RegisterAllocation {
+    // Indexed by TempId. kNoRegister for temps which don't appear in the program.
+    std::vector<Register> tempRegisters;
+    size_t numRegisters = 1;
+    // Moves whose source and destination ended up in the same register, and so
+    // don't need to be emitted.
+    size_t coalescedMoves = 0;
+
+    Register regFor(TempId id) const {
+        assert(id < tempRegisters.size() && tempRegisters[id] != kNoRegister);
+        return tempRegisters[id];
+    }
+    bool isCoalesced(const LInstrMove& m) const {
+        return regFor(m.dst) == regFor(m.src);
+    }
+};
+
+// Linear scan register allocation over the live intervals (Poletto and Sarkar,
+// with the lifetime holes of Wimmer and Mössenböck but no splitting: we have as
+// many registers as we like, so nothing ever has to be spilled). Temps connected
+// by a move prefer the same register, which turns the moves phi removal leaves
+// behind into no-ops. The result always goes in register 0.
+RegisterAllocation allocateRegisters(const CompilationResult& r) {
+    ControlFlowGraph cfg(r);
+    auto intervals = computeLiveIntervals(r, cfg);
+    auto n = intervals.size();
+
+    RegisterAllocation alloc;
+    alloc.tempRegisters.assign(n, kNoRegister);
+
+    // Both ends of every move, as hints. The partners of temp t are
+    // partnerList[partnerStart[t], partnerStart[t + 1]).
+    std::vector<size_t> partnerStart(n + 1, 0);
+    for (const auto& instr : r.instructions) {
+        if (auto m = getAlternative<LInstrMove>(instr)) {
+            ++partnerStart[m->dst + 1];
+            ++partnerStart[m->src + 1];
+        }
+    }
+    for (size_t id = 0; id < n; ++id) {
+        partnerStart[id + 1] += partnerStart[id];
+    }
+    std::vector<TempId> partnerList(partnerStart.back());
+    std::vector<size_t> fill(partnerStart.begin(), partnerStart.end() - 1);
+    for (const auto& instr : r.instructions) {
+        if (auto m = getAlternative<LInstrMove>(instr)) {
+            partnerList[fill[m->dst]++] = m->src;
+            partnerList[fill[m->src]++] = m->dst;
+        }
+    }
+
+    std::vector<TempId> order;
+    for (TempId id = 0; id < n; ++id) {
+        if (!intervals[id].empty()) {
+            order.push_back(id);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](TempId a, TempId b) {
+        return intervals[a].start() < intervals[b].start();
+    });
+
+    auto result = intervals[r.tempId];
+    size_t resultCursor = 0;
+    // Intervals which have started, split by whether they cover the current
+    // position. cursor[id] is the first range of 'id' which hasn't ended yet.
+    std::vector<TempId> active;
+    std::vector<TempId> stillActive;
+    std::vector<TempId> inactive;
+    std::vector<size_t> cursor(n, 0);
+    std::vector<char> blocked;
+
+    for (auto id : order) {
+        auto current = intervals[id];
+        auto pos = current.start();
+
+        // Returns false once the interval has ended for good.
+        auto advance = [&](TempId t) {
+            auto ranges = intervals[t].ranges;
+            while (cursor[t] < ranges.size() && ranges[cursor[t]].end <= pos) {
+                ++cursor[t];
+            }
+            return cursor[t] < ranges.size();
+        };
+        auto covers = [&](TempId t) {
+            return intervals[t].ranges[cursor[t]].start <= pos;
+        };
+        stillActive.clear();
+        for (auto t : active) {
+            if (advance(t)) {
+                (covers(t) ? stillActive : inactive).push_back(t);
+            }
+        }
+        std::swap(active, stillActive);
+        for (size_t i = 0; i < inactive.size();) {
+            auto t = inactive[i];
+            if (advance(t) && !covers(t)) {
+                ++i;
+                continue;
+            }
+            if (cursor[t] < intervals[t].ranges.size()) {
+                active.push_back(t);
+            }
+            inactive[i] = inactive.back();
+            inactive.pop_back();
+        }
+
+        Register reg;
+        if (id == r.tempId) {
+            reg = 0;
+        } else {
+            blocked.assign(alloc.numRegisters, false);
+            for (auto t : active) {
+                blocked[alloc.tempRegisters[t]] = true;
+            }
+            for (auto t : inactive) {
+                if (intersects(intervals[t], cursor[t], current)) {
+                    blocked[alloc.tempRegisters[t]] = true;
+                }
+            }
+            while (resultCursor < result.ranges.size() &&
+                   result.ranges[resultCursor].end <= pos) {
+                ++resultCursor;
+            }
+            if (intersects(result, resultCursor, current)) {
+                blocked[0] = true;
+            }
+
+            reg = kNoRegister;
+            for (size_t i = partnerStart[id]; i < partnerStart[id + 1]; ++i) {
+                auto p = partnerList[i];
+                auto hint = alloc.tempRegisters[p];
+                if (hint != kNoRegister && !blocked[hint]) {
+                    reg = hint;
+                    break;
+                }
+            }
+            if (reg == kNoRegister) {
+                auto free = std::find(blocked.begin(), blocked.end(), false);
+                reg = free - blocked.begin();
+            }
+            assert(reg < kNoRegister);
+            alloc.numRegisters = std::max<size_t>(alloc.numRegisters, reg + 1);
+            active.push_back(id);
+        }
+        alloc.tempRegisters[id] = reg;
+    }
+
+    for (const auto& instr : r.instructions) {
+        if (auto m = getAlternative<LInstrMove>(instr)) {
+            alloc.coalescedMoves += alloc.isCoalesced(*m);
+        }
+    }
+    return alloc;
+}
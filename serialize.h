@@ -0,0 +1,335 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "value.h"
+#include "assembler.h"
+#include "exec.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define EXEC_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define EXEC_HAS_MMAP 0
+#endif
+
+// On disk format of a CompiledProgram. A file is a header followed by the constant
+// pool and the bytecode, both exactly as CompiledProgram uses them, so a loaded
+// program runs straight out of the file's memory:
+//
+//   [ProgramFileHeader] [constants: ValTagOwned * n] [bytecode]
+//
+// Nothing in the bytecode is an address: jumps are relative, and constants and
+// slots are referred to by index. So the file can be mapped anywhere, and shared by
+// any number of processes, without relocating anything. Packed builds rebuild
+// their small table of packed constants when loading, since boxed ones point into
+// the pool.
+//
+// Files are only readable by builds with the same instruction set and value
+// layout. The version has to be bumped whenever either changes, though adding an
+// InstrCode, which is the usual change, is also caught by numOpcodes.
+const char kProgramFileMagic[8] = {'E', 'X', 'P', 'R', 'P', 'R', 'O', 'G'};
+const uint32_t kProgramFileVersion = 1;
+// Written in the byte order of the machine, so a file from one with the other
+// byte order is rejected.
+const uint32_t kProgramFileByteOrder = 0x01020304;
+
+struct ProgramFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint16_t numOpcodes;
+    uint16_t valueSize;
+    uint32_t numRegisters;
+    uint32_t numSlots;
+    uint32_t padding;
+    // Offsets are from the start of the file.
+    uint64_t constantsOffset;
+    uint64_t numConstants;
+    uint64_t codeOffset;
+    uint64_t codeSize;
+};
+static_assert(sizeof(ProgramFileHeader) == 64);
+static_assert(std::is_trivially_copyable_v<ProgramFileHeader>);
+
+// The pool is read in place, so the layout of ValTagOwned is part of the format.
+static_assert(offsetof(ValTagOwned, val) == 0);
+static_assert(offsetof(ValTagOwned, tag) == 8);
+static_assert(offsetof(ValTagOwned, owned) == 9);
+static_assert(sizeof(ValTagOwned) == 16);
+
+// Serializes 'p'. Fails if it has an owned constant, whose payload only means
+// something in this process, or one whose tag packed builds can't hold.
+std::optional<std::vector<char>> serializeProgram(const CompiledProgram& p) {
+    for (const auto& c : p.constants) {
+        if (c.owned || c.tag >= 0x80) {
+            return {};
+        }
+    }
+
+    ProgramFileHeader header{};
+    memcpy(header.magic, kProgramFileMagic, sizeof(header.magic));
+    header.version = kProgramFileVersion;
+    header.byteOrder = kProgramFileByteOrder;
+    header.numOpcodes = kWide + 1;
+    header.valueSize = sizeof(ValTagOwned);
+    header.numRegisters = uint32_t(p.numRegisters);
+    header.numSlots = uint32_t(p.numSlots);
+    header.constantsOffset = sizeof(ProgramFileHeader);
+    header.numConstants = p.constants.size();
+    header.codeOffset = header.constantsOffset + p.constants.size() * sizeof(ValTagOwned);
+    header.codeSize = p.instructions.size();
+
+    std::vector<char> out(header.codeOffset + header.codeSize, 0);
+    memcpy(out.data(), &header, sizeof(header));
+    // Field by field, so the padding in ValTagOwned is written as zeros.
+    char* pool = out.data() + header.constantsOffset;
+    for (const auto& c : p.constants) {
+        writeToMemory(pool + offsetof(ValTagOwned, val), c.val);
+        writeToMemory(pool + offsetof(ValTagOwned, tag), c.tag);
+        writeToMemory(pool + offsetof(ValTagOwned, owned), c.owned);
+        pool += sizeof(ValTagOwned);
+    }
+    memcpy(out.data() + header.codeOffset, p.instructions.data(), p.instructions.size());
+    return out;
+}
+
+bool writeProgramFile(const CompiledProgram& p, const std::string& path) {
+    auto bytes = serializeProgram(p);
+    if (!bytes) {
+        return false;
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes->data(), bytes->size());
+    return bool(out);
+}
+
+// Checks that running 'code' can't go outside of the program: every instruction is
+// complete and known, operands are in range, and jumps land on an instruction or
+// the end. Files can be damaged, and the interpreter trusts its bytecode. 'numSlots'
+// has to be exactly one past the highest slot read, as the assembler sets it, since
+// callers size their slot tables by it.
+bool verifyBytecode(std::span<const char> code,
+                    size_t numConstants,
+                    size_t numRegisters,
+                    size_t numSlots) {
+    if (code.size() % kInstructionSize != 0) {
+        return false;
+    }
+    size_t slotsRead = 0;
+    // Offsets at which an instruction starts, plus the end.
+    std::vector<bool> starts(code.size() + 1, false);
+    std::vector<size_t> targets;
+    auto isReg = [&](uint32_t r) {
+        return r < numRegisters;
+    };
+    for (size_t off = 0; off < code.size();) {
+        starts[off] = true;
+        if (uint8_t(code[off]) > kWide) {
+            return false;
+        }
+        if (code[off] == kWide && (code.size() - off < kWideInstructionSize ||
+                                   uint8_t(code[off + 1]) >= kWide)) {
+            return false;
+        }
+
+        auto d = decodeInstr(code.data(), off);
+        bool ok = true;
+        switch (d.op) {
+        case kLoadConst:
+            ok = isReg(d.a) && size_t(d.x) < numConstants;
+            break;
+        case kLoadSlot:
+            ok = isReg(d.a) && size_t(d.x) < numSlots;
+            slotsRead = std::max(slotsRead, size_t(d.x) + 1);
+            break;
+        case kMove:
+        case kTestEq:
+        case kAddImm:
+            ok = isReg(d.a) && isReg(d.b);
+            break;
+        case kAdd:
+        case kFillEmpty:
+        case kAddInt:
+            ok = isReg(d.a) && isReg(d.b) && isReg(d.c);
+            break;
+        case kAddConst:
+            ok = isReg(d.a) && isReg(d.b) && size_t(d.x) < numConstants;
+            break;
+        case kLoadImmInt:
+            ok = isReg(d.a);
+            break;
+        case kLoadImmTag:
+            // Only what fitsImmediateTag() lets the assembler emit. Any other tag
+            // could have the boxed bit set once it's in a packed register, and a
+            // wide one would be truncated by Tag(d.b).
+            ok = isReg(d.a) && (d.b == kTagBool || d.b == kTagNothing) && d.x <= 0xff;
+            break;
+        case kTestTruthy:
+        case kTestFalsey:
+        case kTestNothing:
+            ok = isReg(d.a);
+            break;
+        case kJmpIfTruthy:
+        case kJmpIfFalsey:
+        case kJmpIfNothing:
+        case kJmpIfTrue:
+        case kJmpIfFalse:
+            ok = isReg(d.a);
+            break;
+        case kJmp:
+            break;
+        case kEq:
+        case kWide:
+            // kEq has no implementation.
+            ok = false;
+            break;
+        }
+        if (!ok) {
+            return false;
+        }
+        // The unfused tests only come in the compact form, and run the compact jmp
+        // after them themselves.
+        bool isUnfusedTest = d.op == kTestEq || d.op == kTestTruthy ||
+            d.op == kTestFalsey || d.op == kTestNothing;
+        if (isUnfusedTest && (d.wide || off + d.size >= code.size() ||
+                              code[off + d.size] != kJmp)) {
+            return false;
+        }
+        if (isJumpInstr(d.op)) {
+            if (d.target > code.size()) {
+                return false;
+            }
+            targets.push_back(d.target);
+        }
+        off += d.size;
+    }
+    starts[code.size()] = true;
+    for (auto t : targets) {
+        if (!starts[t]) {
+            return false;
+        }
+    }
+    return slotsRead == numSlots;
+}
+
+// Checks the raw bytes of a constant pool entry: serialized constants are never
+// owned, and tags have to fit in a packed register, so any build can load any file.
+bool verifyConstant(const char* c) {
+    return c[offsetof(ValTagOwned, owned)] == 0 &&
+        uint8_t(c[offsetof(ValTagOwned, tag)]) < 0x80;
+}
+
+// A program running out of 'bytes', which must stay alive and unmodified for as
+// long as the program is used. Null if they aren't a valid program file for this
+// build, or if they aren't aligned well enough to read the constants in place.
+std::unique_ptr<CompiledProgram> loadProgram(std::span<const char> bytes) {
+    if (bytes.size() < sizeof(ProgramFileHeader)) {
+        return nullptr;
+    }
+    auto header = readFromMemory<ProgramFileHeader>(bytes.data());
+    bool compatible = memcmp(header.magic, kProgramFileMagic, sizeof(header.magic)) == 0 &&
+        header.version == kProgramFileVersion &&
+        header.byteOrder == kProgramFileByteOrder &&
+        header.numOpcodes == kWide + 1 &&
+        header.valueSize == sizeof(ValTagOwned);
+    if (!compatible) {
+        return nullptr;
+    }
+
+    // Every register has to be addressable by a wide instruction.
+    if (header.numRegisters > 0x10000) {
+        return nullptr;
+    }
+    auto fits = [&](uint64_t offset, uint64_t size) {
+        return offset <= bytes.size() && size <= bytes.size() - offset;
+    };
+    if (header.numConstants > bytes.size() / sizeof(ValTagOwned) ||
+        !fits(header.constantsOffset, header.numConstants * sizeof(ValTagOwned)) ||
+        !fits(header.codeOffset, header.codeSize)) {
+        return nullptr;
+    }
+    const char* pool = bytes.data() + header.constantsOffset;
+    if (uintptr_t(pool) % alignof(ValTagOwned) != 0) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < header.numConstants; ++i) {
+        if (!verifyConstant(pool + i * sizeof(ValTagOwned))) {
+            return nullptr;
+        }
+    }
+
+    std::span<const char> code(bytes.data() + header.codeOffset, header.codeSize);
+    if (!verifyBytecode(code, header.numConstants, header.numRegisters, header.numSlots)) {
+        return nullptr;
+    }
+    std::span<const ValTagOwned> constants((const ValTagOwned*)pool, header.numConstants);
+    return std::make_unique<CompiledProgram>(code, constants, header.numRegisters,
+                                             header.numSlots);
+}
+
+// A program file mapped into memory read only, so loading it doesn't read or copy
+// anything beyond what running it touches, and processes mapping the same file share
+// its pages.
+struct MappedProgram {
+    // Null if the file can't be mapped or isn't a valid program file.
+    static std::unique_ptr<MappedProgram> open(const std::string& path) {
+#if EXEC_HAS_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        size_t size = st.st_size;
+        void* mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping stays valid after the descriptor is closed.
+        ::close(fd);
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+        std::unique_ptr<MappedProgram> res(new MappedProgram(mem, size));
+        res->program = loadProgram({(const char*)mem, size});
+        if (!res->program) {
+            return nullptr;
+        }
+        return res;
+#else
+        return nullptr;
+#endif
+    }
+
+    MappedProgram(const MappedProgram&) = delete;
+    MappedProgram& operator=(const MappedProgram&) = delete;
+    ~MappedProgram() {
+        // The program refers to the mapping, so it has to go first.
+        program.reset();
+#if EXEC_HAS_MMAP
+        munmap(mem, size);
+#endif
+    }
+
+    std::unique_ptr<CompiledProgram> program;
+
+private:
+    MappedProgram(void* m, size_t s)
+        : mem(m),
+          size(s) {
+    }
+
+    void* mem;
+    size_t size;
+};
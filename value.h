@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cassert>
+#include <cstring>
 #include <iostream>
 #include <variant>
 #include <math.h>
@@ -41,7 +43,6 @@ using Tag = uint8_t;
 const Tag kTagNothing = 0;
 const Tag kTagInt = 1;
 const Tag kTagBool = 2;
-const Tag kTagSlot = 3;
 
 
 
@@ -71,6 +72,128 @@ struct ValTag {
     Value val;
     Tag tag;
 };
-struct SlotAccessor {
-    ValTagOwned data;
+
+// Values as they are stored at runtime, in registers, constants and slot tables.
+// By default this is just ValTagOwned. Building with EXEC_PACKED_VALUES=1 packs
+// them into 8 bytes instead, so twice as many registers fit in a cache line.
+#ifndef EXEC_PACKED_VALUES
+#define EXEC_PACKED_VALUES 0
+#endif
+
+#if EXEC_PACKED_VALUES
+// The tag lives in the low 7 bits and the value in the 56 bits above it, sign
+// extended. Ints wrap at 56 bits. Values which don't fit, and owned values, are
+// boxed: bit 7 is set and the payload is a pointer to the original ValTagOwned,
+// which whoever packed it has to keep alive. The tag is kept inline even for boxed
+// values, so checking for Nothing never has to unbox.
+struct PackedValue {
+    uint64_t bits = 0;
 };
+static_assert(sizeof(PackedValue) == 8);
+
+const uint64_t kPackedTagMask = 0x7f;
+const uint64_t kPackedBoxed = 0x80;
+const int kPackedPayloadShift = 8;
+
+inline bool isBoxed(PackedValue p) {
+    return p.bits & kPackedBoxed;
+}
+inline const ValTagOwned* unbox(PackedValue p) {
+    return (const ValTagOwned*)(p.bits >> kPackedPayloadShift);
+}
+
+using RegisterValue = PackedValue;
+
+// For values known to fit, like immediates.
+inline PackedValue makeRegister(Value v, Tag t) {
+    assert(t <= kPackedTagMask);
+    assert(int64_t(v << kPackedPayloadShift) >> kPackedPayloadShift == int64_t(v));
+    return PackedValue{(v << kPackedPayloadShift) | t};
+}
+// Boxes 'v' if it doesn't fit, in which case the result refers to 'v' itself.
+inline PackedValue toRegister(const ValTagOwned& v) {
+    assert(v.tag <= kPackedTagMask);
+    auto s = int64_t(v.val);
+    if (!v.owned && (s << kPackedPayloadShift) >> kPackedPayloadShift == s) {
+        return makeRegister(v.val, v.tag);
+    }
+    auto ptr = uint64_t(&v);
+    assert(ptr >> (64 - kPackedPayloadShift) == 0);
+    return PackedValue{(ptr << kPackedPayloadShift) | kPackedBoxed | v.tag};
+}
+inline ValTagOwned fromRegister(PackedValue p) {
+    if (isBoxed(p)) {
+        return *unbox(p);
+    }
+    return ValTagOwned{Value(int64_t(p.bits) >> kPackedPayloadShift),
+                       Tag(p.bits & kPackedTagMask)};
+}
+
+inline bool isNothing(PackedValue p) {
+    return (p.bits & kPackedTagMask) == kTagNothing;
+}
+inline bool isTruthy(PackedValue p) {
+    // A boxed value can only be falsey if it's owned.
+    return (p.bits >> kPackedPayloadShift) != 0 && (!isBoxed(p) || unbox(p)->val != 0);
+}
+inline bool valuesEqual(PackedValue l, PackedValue r) {
+    if (l.bits == r.bits) {
+        return true;
+    }
+    // Equal values can be boxed in different places.
+    return ((l.bits | r.bits) & kPackedBoxed) && fromRegister(l) == fromRegister(r);
+}
+#else
+using RegisterValue = ValTagOwned;
+
+inline ValTagOwned makeRegister(Value v, Tag t) {
+    return ValTagOwned{v, t};
+}
+inline const ValTagOwned& toRegister(const ValTagOwned& v) {
+    return v;
+}
+inline const ValTagOwned& fromRegister(const ValTagOwned& v) {
+    return v;
+}
+
+inline bool isNothing(const ValTagOwned& v) {
+    return v.tag == kTagNothing;
+}
+inline bool isTruthy(const ValTagOwned& v) {
+    return v.val != 0;
+}
+inline bool valuesEqual(const ValTagOwned& l, const ValTagOwned& r) {
+    return l == r;
+}
+#endif
+
+// Evaluating constants at compile time. These follow what the instructions do at
+// runtime, so folding can't change a result.
+bool isConstNothing(const ValTagOwned& v) {
+    return v.tag == kTagNothing;
+}
+bool isConstTruthy(const ValTagOwned& v) {
+    return v.val != 0;
+}
+// The int an add leaves in a register when the full sum is 'v'. Packed registers
+// wrap at 56 bits. Anything which adds outside of the packed representation, like
+// constant folding or the batch kernels, goes through this to get the same result.
+inline Value wrapInt(Value v) {
+#if EXEC_PACKED_VALUES
+    return Value(int64_t(v << kPackedPayloadShift) >> kPackedPayloadShift);
+#else
+    return v;
+#endif
+}
+
+ValTagOwned addConsts(const ValTagOwned& l, const ValTagOwned& r) {
+    if (isConstNothing(l) || isConstNothing(r)) {
+        return makeNothing();
+    }
+    return ValTagOwned{wrapInt(l.val + r.val), kTagInt};
+}
+
+// Slots are the inputs of a program. A compiled program reads slot i from entry i
+// of a table of values supplied by whoever runs it, so the same program can be
+// run against new inputs without recompiling.
+using SlotId = uint32_t;